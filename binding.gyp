@@ -4,8 +4,9 @@
          'with_jpeg%': 'true',
          'with_gif%':  'true',
          'with_webp%': 'true',
-         'with_bmp%':  'false',
+         'with_bmp%':  'true',
          'with_raw%':  'true',
+         'with_qoi%':  'true',
      },
     'targets': [{
         'target_name': 'binding',
@@ -38,7 +39,7 @@
                     'gyp/gyp/giflib.gyp:giflib',
                 ]
             }],
-            ['with_webp=="false"', {
+            ['with_webp=="true"', {
                 'defines': ['HAVE_WEBP'],
                 'sources': ['src/Webp.cc'],
                 'dependencies': [
@@ -52,6 +53,10 @@
             ['with_raw=="true"', {
                 'defines': ['HAVE_RAW'],
                 'sources': ['src/Raw.cc']
+            }],
+            ['with_qoi=="true"', {
+                'defines': ['HAVE_QOI'],
+                'sources': ['src/Qoi.cc']
             }]
         ]
     }]
@@ -29,15 +29,40 @@
 var USE_OLD_API = false,
     fs = require("fs"),
     path = require("path"),
+    Readable = require("stream").Readable,
+    Writable = require("stream").Writable,
     _images = require("./scripts/util/binding.js")(),
     _Image = _images.Image,
     slice = Array.prototype.slice,
     FILE_TYPE_MAP,
     CONFIG_GENERATOR,
+    PNG_STRATEGY,
+    PNG_FILTER,
+    PNG_COLOR_TYPE,
+    PNG_PRESET,
+    RAW_ORDER,
+    FRAME_DISPOSAL = ["none", "background", "previous"],
+    FRAME_CACHE_SIZE = 8,
     prototype,
     nextGCThreshold = 0,
     gcThreshold = 0;
 
+function decodeOptions(options) {
+    var crop = options.region || options.crop || {};
+    return {
+        cropX: crop.x,
+        cropY: crop.y,
+        cropWidth: crop.width !== undefined ? crop.width : crop.w,
+        cropHeight: crop.height !== undefined ? crop.height : crop.h,
+        width: options.width,
+        height: options.height,
+        autoOrient: !!options.autoOrient,
+        thumbnail: !!options.thumbnail,
+        maxPixels: options.maxPixels,
+        maxBytes: options.maxBytes
+    };
+}
+
 function WrappedImage(width, height) {
     if (!(this instanceof WrappedImage)) return new WrappedImage(width, height);
     if (gcThreshold && nextGCThreshold) {
@@ -50,8 +75,18 @@ function WrappedImage(width, height) {
 }
 
 prototype = {
-    loadFromBuffer: function(buffer, start, end) {
-        this._handle.loadFromBuffer(buffer, start, end);
+    loadFromBuffer: function(buffer, start, end, options) {
+        if (start && typeof(start) == "object") {
+            options = start;
+            start = undefined;
+        }
+        this._handle.loadFromBuffer(buffer, start, end, options && decodeOptions(options));
+    },
+    decodeChunk: function(buffer, start, end, options) {
+        return this._handle.decodeChunk(buffer, start, end, options && decodeOptions(options));
+    },
+    decodeEnd: function() {
+        this._handle.decodeEnd();
     },
     copyFromImage: function(img, x, y, width, height) {
         if (img instanceof WrappedImage) {
@@ -68,8 +103,12 @@ prototype = {
         }
         this._handle.drawImage(img, x, y);
     },
-    encode: function(type, config) {
+    encode: function(type, config, target) {
         var configurator;
+        if (typeof(config) == "function" || config instanceof Buffer) {
+            target = config;
+            config = undefined;
+        }
         if (typeof(type) != "number") {
             type = String(type).toLowerCase();
             type = (FILE_TYPE_MAP["." + type] || FILE_TYPE_MAP[type]);
@@ -78,7 +117,80 @@ prototype = {
             configurator = CONFIG_GENERATOR[type];
             config = configurator && configurator(config);
         }
-        return this._handle.toBuffer(type, config);
+        return this._handle.toBuffer(type, config, target);
+    },
+    encodeMany: function(outputs, callback) {
+        var types = [],
+            configs = [];
+        outputs.forEach(function(output) {
+            var type = output.type,
+                config = output.config,
+                configurator;
+            if (typeof(type) != "number") {
+                type = String(type).toLowerCase();
+                type = (FILE_TYPE_MAP["." + type] || FILE_TYPE_MAP[type]);
+            }
+            if (config != undefined) {
+                configurator = CONFIG_GENERATOR[type];
+                config = configurator && configurator(config);
+            }
+            types.push(type);
+            configs.push(config);
+        });
+        if (types.length == 0) {
+            process.nextTick(callback, null, []);
+            return;
+        }
+        this._handle.encodeMany(types, configs, callback);
+    },
+    encodeInto: function(buffer, type, config) {
+        return this.encode(type, config, buffer);
+    },
+    encodeStream: function(type, config) {
+        var stream = new Readable(),
+            ended = false,
+            read = null,
+            configurator;
+
+        if (typeof(type) != "number") {
+            type = String(type).toLowerCase();
+            type = (FILE_TYPE_MAP["." + type] || FILE_TYPE_MAP[type]);
+        }
+        if (config != undefined) {
+            configurator = CONFIG_GENERATOR[type];
+            config = configurator && configurator(config);
+        }
+
+        // The encoder runs on the thread pool and waits while push() reports a full buffer
+        try {
+            read = this._handle.encodeStream(type, config, function(err, chunk) {
+                if (ended) return false;
+                if (err) {
+                    ended = true;
+                    stream.emit("error", err);
+                    return false;
+                }
+                if (chunk === null) ended = true;
+                return stream.push(chunk);
+            });
+        } catch (err) {
+            ended = true;
+            process.nextTick(function() {
+                stream.emit("error", err);
+            });
+        }
+
+        stream._read = function() {
+            if (!ended) read();
+        };
+        stream._destroy = function(err, callback) {
+            if (!ended) {
+                ended = true;
+                read(false);
+            }
+            callback(err);
+        };
+        return stream;
     },
     save: function(file, type, config) {
         if (type && typeof(type) == "object") {
@@ -105,8 +217,12 @@ prototype = {
         fs.writeFile(file, this.encode(type || path.extname(file), config), callback);
         return this;
     },
-    resize: function(width, height, filter) {
-        this._handle.resize(width, height, filter);
+    resize: function(width, height, filter, options) {
+        if (typeof filter === 'object' && filter !== null) {
+            options = filter;
+            filter = undefined;
+        }
+        this._handle.resize(width, height, filter, !(options && options.precision === 'float'));
         return this;
     },
     rotate: function(deg) {
@@ -162,6 +278,95 @@ bind(WrappedImage.prototype, prototype, {
     "draw": ["drawImage"]
 });
 
+function AnimatedImage(buffer, options) {
+    var info;
+    if (!(this instanceof AnimatedImage)) return new AnimatedImage(buffer, options);
+    options = options || {};
+    info = new _Image().getFrames(buffer, decodeOptions(options));
+    this._buffer = buffer;
+    this._type = info.type;
+    this._cache = [];
+    this._cacheSize = Math.max(1, options.cacheSize || FRAME_CACHE_SIZE);
+    this.width = info.width;
+    this.height = info.height;
+    this.loop = info.loop;
+    this.frames = info.frames.map(function(frame) {
+        frame.disposal = FRAME_DISPOSAL[frame.disposal];
+        return frame;
+    });
+}
+
+AnimatedImage.prototype = {
+    frameCount: function() {
+        return this.frames.length;
+    },
+    frame: function(index) {
+        return images.copyFromImage(this._render(index));
+    },
+    forEach: function(callback) {
+        var i;
+        for (i = 0; i < this.frames.length; i++) {
+            callback.call(this, this.frame(i), i, this.frames[i]);
+        }
+        return this;
+    },
+    _cached: function(index) {
+        var cache = this._cache,
+            i, entry;
+        for (i = 0; i < cache.length; i++) {
+            if (cache[i].index === index) {
+                // Move to the most recently used end
+                entry = cache.splice(i, 1)[0];
+                cache.push(entry);
+                return entry.image;
+            }
+        }
+    },
+    _remember: function(index, image) {
+        this._cache.push({
+            index: index,
+            image: image
+        });
+        if (this._cache.length > this._cacheSize) this._cache.shift();
+    },
+    _dispose: function(canvas, index, previous) {
+        var frame = this.frames[index];
+        if (frame.disposal == "background") {
+            canvas._handle.clearRect(frame.x, frame.y, frame.width, frame.height);
+        } else if (frame.disposal == "previous" && previous) {
+            canvas._handle.copyFromImage(previous._handle);
+        }
+    },
+    _render: function(index) {
+        var frames = this.frames,
+            canvas, cached, previous, start, i;
+
+        if (!(index >= 0 && index < frames.length)) throw new RangeError("Frame index out of range.");
+        if ((canvas = this._cached(index))) return canvas;
+
+        // Resume from the closest cached frame, a "previous" disposal can't be replayed from it
+        for (start = index - 1; start >= 0; start--) {
+            if (frames[start].disposal != "previous" && (cached = this._cached(start))) break;
+        }
+
+        if (start >= 0) {
+            canvas = images.copyFromImage(cached);
+            this._dispose(canvas, start);
+        } else {
+            canvas = WrappedImage(this.width, this.height);
+        }
+
+        for (i = start + 1; i <= index; i++) {
+            if (i > start + 1) this._dispose(canvas, i - 1, previous);
+            previous = frames[i].disposal == "previous" ? images.copyFromImage(canvas) : null;
+            canvas._handle.drawFrame(this._buffer, this._type, i);
+        }
+
+        this._remember(index, canvas);
+        return canvas;
+    }
+};
+
 function images(obj) {
     var constructor;
     if (obj instanceof Buffer) {
@@ -182,6 +387,7 @@ images.TYPE_GIF = _images.TYPE_GIF;
 images.TYPE_BMP = _images.TYPE_BMP;
 images.TYPE_RAW = _images.TYPE_RAW;
 images.TYPE_WEBP = _images.TYPE_WEBP;
+images.TYPE_QOI = _images.TYPE_QOI;
 
 FILE_TYPE_MAP = {
     ".png": images.TYPE_PNG,
@@ -190,41 +396,200 @@ FILE_TYPE_MAP = {
     ".gif": images.TYPE_GIF,
     ".bmp": images.TYPE_BMP,
     ".raw": images.TYPE_RAW,
-    ".webp": images.TYPE_WEBP
+    ".webp": images.TYPE_WEBP,
+    ".qoi": images.TYPE_QOI
 };
 
 CONFIG_GENERATOR = [];
-//CONFIG_GENERATOR[images.TYPE_PNG]
+
+PNG_STRATEGY = {
+    "default": 0,
+    "filtered": 1,
+    "huffman": 2,
+    "rle": 3,
+    "fixed": 4
+};
+
+PNG_FILTER = {
+    "none": 0x08,
+    "sub": 0x10,
+    "up": 0x20,
+    "average": 0x40,
+    "paeth": 0x80,
+    "all": 0xF8
+};
+
+PNG_COLOR_TYPE = {
+    "auto": 0xFF,
+    "gray": 0,
+    "rgb": 2,
+    "palette": 3,
+    "graya": 4,
+    "rgba": 6
+};
+
+PNG_PRESET = {
+    "fast": {
+        level: 1,
+        strategy: "rle",
+        filter: "sub"
+    },
+    "best": {
+        level: 9,
+        memLevel: 9,
+        filter: "all"
+    }
+};
+
+CONFIG_GENERATOR[images.TYPE_PNG] = function(config) {
+    var PNG_CONFIG_SIZE = 10,
+        PNG_CONFIG_DEFAULT = 0xFF,
+        ret = new Buffer(PNG_CONFIG_SIZE),
+        preset = PNG_PRESET[config.preset] || {},
+        option = function(name, map) {
+            var value = config[name] === undefined ? preset[name] : config[name];
+            if (value === undefined) return PNG_CONFIG_DEFAULT;
+            if (map) {
+                return [].concat(value).reduce(function(mask, item) {
+                    return mask | (typeof(item) == "number" ? item : map[item]);
+                }, 0);
+            }
+            return value;
+        };
+
+    ret.write("PNG ", 0, 4, "ascii");
+    ret[4] = option("level");
+    ret[5] = option("memLevel");
+    ret[6] = option("windowBits");
+    ret[7] = option("strategy", PNG_STRATEGY);
+    ret[8] = option("filter", PNG_FILTER);
+    ret[9] = option("colorType", PNG_COLOR_TYPE);
+    return ret;
+};
+
 CONFIG_GENERATOR[images.TYPE_JPEG] = function(config) {
-    var JPEG_CONFIG_SIZE = 5,
+    var JPEG_CONFIG_SIZE = 9,
         ret = new Buffer(JPEG_CONFIG_SIZE);
 
     ret.write("JPEG", 0, 4, "ascii");
     ret[4] = config.quality === undefined ? 100 : config.quality;
+    ret.writeUInt32LE(Math.min(0xFFFFFFFF, config.maxBytes || 0), 5);
+    return ret;
+};
+
+CONFIG_GENERATOR[images.TYPE_GIF] = function(config) {
+    var GIF_CONFIG_SIZE = 6,
+        ret = new Buffer(GIF_CONFIG_SIZE),
+        colors = config.colors === undefined ? 256 : config.colors;
+
+    ret.write("GIF ", 0, 4, "ascii");
+    ret[4] = Math.max(2, Math.min(256, colors)) & 0xFF;
+    ret[5] = config.dither ? 1 : 0;
+    return ret;
+};
+
+CONFIG_GENERATOR[images.TYPE_WEBP] = function(config) {
+    var WEBP_CONFIG_SIZE = 14,
+        WEBP_CONFIG_DEFAULT = 0xFF,
+        ret = new Buffer(WEBP_CONFIG_SIZE),
+        option = function(name) {
+            return config[name] === undefined ? WEBP_CONFIG_DEFAULT : config[name];
+        };
+
+    ret.write("WEBP", 0, 4, "ascii");
+    ret[4] = option("quality");
+    ret[5] = option("method");
+    ret[6] = option("alphaQuality");
+    ret[7] = option("nearLossless");
+    ret[8] = config.lossless ? 1 : 0;
+    ret[9] = config.threads ? 1 : 0;
+    ret.writeUInt32LE(Math.min(0xFFFFFFFF, config.maxBytes || 0), 10);
+    return ret;
+};
+
+RAW_ORDER = {
+    "rgba": 0,
+    "bgra": 1,
+    "argb": 2,
+    "abgr": 3
+};
+
+CONFIG_GENERATOR[images.TYPE_RAW] = function(config) {
+    var RAW_CONFIG_SIZE = 6,
+        ret = new Buffer(RAW_CONFIG_SIZE);
+
+    ret.write("RAW ", 0, 4, "ascii");
+    ret[4] = RAW_ORDER[String(config.order || "rgba").toLowerCase()] || 0;
+    ret[5] = config.align || 0;
     return ret;
 };
 
 images.Image = WrappedImage;
 
-images.loadFromFile = function(file) {
-    return images.loadFromBuffer(fs.readFileSync(file));
+images.loadFromFile = function(file, options) {
+    return images.loadFromBuffer(fs.readFileSync(file), options);
+};
+
+images.AnimatedImage = AnimatedImage;
+
+images.loadAnimation = function(obj, options) {
+    return AnimatedImage(typeof(obj) == "string" ? fs.readFileSync(obj) : obj, options);
 };
 
 images.createImage = function(width, height) {
     return WrappedImage(width, height);
 };
 
-images.loadFromBuffer = function(buffer, start, end) {
-    return WrappedImage().loadFromBuffer(buffer, start, end);
+images.loadFromBuffer = function(buffer, start, end, options) {
+    return WrappedImage().loadFromBuffer(buffer, start, end, options);
+};
+
+images.extractThumbnail = function(buffer, width, height) {
+    if (!width && !height) width = 160;
+    return images.loadFromBuffer(buffer, {
+        width: width,
+        height: height,
+        thumbnail: true,
+        autoOrient: true
+    });
+};
+
+images.createDecodeStream = function(options) {
+    var image = WrappedImage(),
+        stream = new Writable();
+
+    stream._write = function(chunk, encoding, next) {
+        var rows;
+        try {
+            rows = image.decodeChunk(chunk, undefined, undefined, options);
+        } catch (err) {
+            return next(err);
+        }
+        stream.emit("rows", rows);
+        next();
+    };
+    stream._final = function(done) {
+        try {
+            image.decodeEnd();
+        } catch (err) {
+            return done(err);
+        }
+        stream.emit("image", image);
+        done();
+    };
+    stream.image = image;
+    return stream;
 };
 
 images.copyFromImage = function(src, x, y, width, height) {
     return WrappedImage().copyFromImage(src, x, y, width, height);
 };
 
-images.setLimit = function(maxWidth, maxHeight) {
+images.setLimit = function(maxWidth, maxHeight, maxPixels, maxBytes) {
     _images.maxHeight = maxHeight;
     _images.maxWidth = maxWidth;
+    if (maxPixels !== undefined) _images.maxPixels = maxPixels;
+    if (maxBytes !== undefined) _images.maxBytes = maxBytes;
     return images;
 };
 
@@ -241,4 +606,57 @@ images.gc = function() {
     return _images.gc();
 };
 
+images.jpegTransform = function(buffer, ops) {
+    var transform = {},
+        crop = ops.crop || {},
+        rotate = ((Number(ops.rotate) || 0) % 360 + 360) % 360;
+
+    // Clockwise rotation, then flip, then crop in the resulting image
+    switch (rotate) {
+        case 0:
+            break;
+        case 90:
+            transform.transpose = true;
+            transform.mirrorX = true;
+            break;
+        case 180:
+            transform.mirrorX = true;
+            transform.mirrorY = true;
+            break;
+        case 270:
+            transform.transpose = true;
+            transform.mirrorY = true;
+            break;
+        default:
+            throw new Error("Rotation must be a multiple of 90.");
+    }
+    if (ops.flip == "horizontal") {
+        transform.mirrorX = !transform.mirrorX;
+    } else if (ops.flip == "vertical") {
+        transform.mirrorY = !transform.mirrorY;
+    }
+    transform.cropX = crop.x;
+    transform.cropY = crop.y;
+    transform.cropWidth = crop.width;
+    transform.cropHeight = crop.height;
+    transform.maxPixels = ops.maxPixels;
+    transform.maxBytes = ops.maxBytes;
+    return _images.jpegTransform(buffer, transform);
+};
+
+images.loadCodec = function(file, configure) {
+    var codecs = _images.loadCodec(path.resolve(file));
+    codecs.forEach(function(codec) {
+        FILE_TYPE_MAP["." + codec.name] = codec.type;
+        images["TYPE_" + codec.name.toUpperCase()] = codec.type;
+        if (configure) {
+            // configure(name, config) returns the Buffer handed to the encoder
+            CONFIG_GENERATOR[codec.type] = function(config) {
+                return configure(codec.name, config);
+            };
+        }
+    });
+    return codecs;
+};
+
 module.exports = USE_OLD_API ? _images : images;
@@ -30,14 +30,308 @@
 
 #ifdef HAVE_BMP
 
-DECODER_FN(Bmp){
-//TODO
-return FAIL;
-}
+#include <stdlib.h>
+#include <string.h>
 
-ENCODER_FN(Bmp){
-//TODO
-return FAIL;
-}
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_V4_HEADER_SIZE 108
+#define BMP_CORE_HEADER_SIZE 12
+
+#define BMP_RGB 0
+#define BMP_BITFIELDS 3
+#define BMP_ALPHABITFIELDS 6
+
+#define BMP_PPM 2835 // 72 DPI
+
+#define BMP_U16(p) ((uint16_t) ((p)[0] | (p)[1] << 8))
+#define BMP_U32(p) ((uint32_t) (p)[0] | (uint32_t) (p)[1] << 8 | (uint32_t) (p)[2] << 16 | (uint32_t) (p)[3] << 24)
+#define BMP_SET16(p, v) do{ (p)[0] = (v) & 0xFF; (p)[1] = ((v) >> 8) & 0xFF; }while(0)
+#define BMP_SET32(p, v) do{ BMP_SET16(p, v); BMP_SET16((p) + 2, (v) >> 16); }while(0)
+
+typedef struct {
+	uint32_t mask;
+	int shift;
+	int bits;
+} bmp_channel;
+
+void bmp_channel_init(bmp_channel *channel, uint32_t mask){ // {{{
+	channel->mask = mask;
+	channel->shift = 0;
+	channel->bits = 0;
+	if(mask == 0) return;
+	while(((mask >> channel->shift) & 1) == 0) channel->shift++;
+	while(channel->shift + channel->bits < 32 && ((mask >> (channel->shift + channel->bits)) & 1)) channel->bits++;
+} // }}}
+
+inline uint8_t bmp_channel_get(bmp_channel *channel, uint32_t value){ // {{{
+	uint32_t v;
+
+	// An empty mask (bits == 0) reads as 0
+	if(channel->bits == 0) return 0;
+	v = (value & channel->mask) >> channel->shift;
+	if(channel->bits >= 8) return v >> (channel->bits - 8);
+	return v * 255 / ((1 << channel->bits) - 1);
+} // }}}
+
+// Row converters, plain loops over fixed size elements so the compiler can vectorize them
+
+// first is the pixel to start with, counted in bits from the start of src
+void bmp_row_indexed(const uint8_t *src, Pixel *dst, size_t first, size_t width, int bpp, Pixel *palette){ // {{{
+	size_t x;
+	int shift, mask;
+
+	if(bpp == 8){
+		src += first;
+		for(x = 0; x < width; x++)
+			dst[x] = palette[src[x]];
+		return;
+	}
+
+	src += first * bpp / 8;
+	mask = (1 << bpp) - 1;
+	shift = 8 - bpp - (int) (first * bpp % 8);
+	for(x = 0; x < width; x++){
+		dst[x] = palette[(*src >> shift) & mask];
+		if(shift == 0){
+			shift = 8 - bpp;
+			src++;
+		}else{
+			shift -= bpp;
+		}
+	}
+} // }}}
+
+void bmp_row_bgr(const uint8_t *src, Pixel *dst, size_t width){ // {{{
+	size_t x;
+
+	for(x = 0; x < width; x++, src += 3){
+		dst[x].R = src[2];
+		dst[x].G = src[1];
+		dst[x].B = src[0];
+		dst[x].A = 0xFF;
+	}
+} // }}}
+
+void bmp_row_bgra(const uint8_t *src, Pixel *dst, size_t width, bool alpha){ // {{{
+	size_t x;
+	uint32_t v, fill;
+	uint8_t *out;
+
+	// Swap B and R within each little endian word
+	out = (uint8_t *) dst;
+	fill = alpha ? 0 : 0xFF000000;
+	for(x = 0; x < width; x++){
+		v = BMP_U32(src + x * 4);
+		v = (v & 0xFF00FF00) | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16) | fill;
+		BMP_SET32(out + x * 4, v);
+	}
+} // }}}
+
+void bmp_row_bitfields(const uint8_t *src, Pixel *dst, size_t width, int bpp, bmp_channel *channels){ // {{{
+	size_t x;
+	uint32_t v;
+
+	for(x = 0; x < width; x++){
+		v = bpp == 16 ? BMP_U16(src + x * 2) : BMP_U32(src + x * 4);
+		dst[x].R = bmp_channel_get(&channels[0], v);
+		dst[x].G = bmp_channel_get(&channels[1], v);
+		dst[x].B = bmp_channel_get(&channels[2], v);
+		dst[x].A = channels[3].mask ? bmp_channel_get(&channels[3], v) : 0xFF;
+	}
+} // }}}
+
+DECODER_FN(Bmp){ // {{{
+	uint8_t *data, *row;
+	size_t length, offset, header, stride, line, y, w, h, colors, entry, masks, cx, cy, cw, ch;
+	int32_t width, height;
+	int bpp, i;
+	uint32_t compression, used;
+	bool topdown, alpha, swizzle;
+	bmp_channel channels[4];
+	Pixel palette[256];
+
+	data = input->data;
+	length = input->length;
+
+	if(length < BMP_FILE_HEADER_SIZE + BMP_CORE_HEADER_SIZE || data[0] != 'B' || data[1] != 'M') return FAIL;
+
+	offset = BMP_U32(data + 10);
+	header = BMP_U32(data + 14);
+	if(header > length - BMP_FILE_HEADER_SIZE) return FAIL;
+
+	if(header == BMP_CORE_HEADER_SIZE){
+		width = BMP_U16(data + 18);
+		height = (int16_t) BMP_U16(data + 20);
+		bpp = BMP_U16(data + 24);
+		compression = BMP_RGB;
+		used = 0;
+		entry = 3;
+	}else if(header >= BMP_INFO_HEADER_SIZE){
+		width = (int32_t) BMP_U32(data + 18);
+		height = (int32_t) BMP_U32(data + 22);
+		bpp = BMP_U16(data + 28);
+		compression = BMP_U32(data + 30);
+		used = BMP_U32(data + 46);
+		entry = 4;
+	}else{
+		return FAIL;
+	}
+
+	// Validate everything against the input before allocating
+	if(width <= 0 || height == 0 || height < -0x7FFFFFFF) return FAIL;
+	topdown = height < 0;
+	w = width;
+	h = topdown ? -height : height;
+
+	if(bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32) return FAIL;
+	if(compression != BMP_RGB && compression != BMP_BITFIELDS && compression != BMP_ALPHABITFIELDS) return FAIL;
+	if(compression != BMP_RGB && bpp != 16 && bpp != 32) return FAIL;
+
+	if(Image::checkSize(w, h, options) != SUCCESS) return FAIL;
+
+	// The last row may come without its padding
+	stride = ((w * bpp + 31) / 32) * 4;
+	line = (w * bpp + 7) / 8;
+	if(offset > length || length - offset < line || (length - offset - line) / stride + 1 < h) return FAIL;
+
+	// Bit masks follow a 40 byte header and sit inside the larger ones
+	masks = 0;
+	bmp_channel_init(&channels[0], bpp == 16 ? 0x7C00 : 0x00FF0000);
+	bmp_channel_init(&channels[1], bpp == 16 ? 0x03E0 : 0x0000FF00);
+	bmp_channel_init(&channels[2], bpp == 16 ? 0x001F : 0x000000FF);
+	bmp_channel_init(&channels[3], 0);
+	if(compression != BMP_RGB){
+		masks = compression == BMP_ALPHABITFIELDS || header >= 56 ? 16 : 12;
+		if(length < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + masks) return FAIL;
+		for(i = 0; i < (int) masks / 4; i++){
+			bmp_channel_init(&channels[i], BMP_U32(data + BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + i * 4));
+		}
+		if(header > BMP_INFO_HEADER_SIZE) masks = 0;
+	}
+
+	memset(palette, 0x00, sizeof(palette));
+	for(i = 0; i < 256; i++) palette[i].A = 0xFF;
+	if(bpp <= 8){
+		colors = used > 0 && used < (1U << bpp) ? used : (1U << bpp);
+		row = data + BMP_FILE_HEADER_SIZE + header + masks;
+		for(i = 0; i < (int) colors && row + entry <= data + length; i++, row += entry){
+			palette[i].R = row[2];
+			palette[i].G = row[1];
+			palette[i].B = row[0];
+		}
+	}
+
+	alpha = channels[3].mask != 0;
+	swizzle = bpp == 32 && channels[0].mask == 0x00FF0000 && channels[1].mask == 0x0000FF00
+		&& channels[2].mask == 0x000000FF && (!alpha || channels[3].mask == 0xFF000000);
+
+	// Rows are random access, only the region is converted
+	cx = cy = 0;
+	cw = w;
+	ch = h;
+	if(options != NULL && options->Crop(w, h, &cx, &cy, &cw, &ch))
+		options->cropped = true;
+
+	if(output->Malloc(cw, ch) != SUCCESS) return FAIL;
+
+	for(y = 0; y < ch; y++){
+		row = data + offset + (topdown ? cy + y : h - 1 - cy - y) * stride;
+		switch(bpp){
+			case 1:
+			case 4:
+			case 8:
+				bmp_row_indexed(row, output->data[y], cx, cw, bpp, palette);
+				break;
+			case 24:
+				bmp_row_bgr(row + cx * 3, output->data[y], cw);
+				break;
+			default:
+				if(swizzle){
+					bmp_row_bgra(row + cx * 4, output->data[y], cw, alpha);
+				}else{
+					bmp_row_bitfields(row + cx * bpp / 8, output->data[y], cw, bpp, channels);
+				}
+				break;
+		}
+	}
+
+	if(alpha){
+		output->DetectTransparent();
+	}else{
+		output->type = SOLID;
+	}
+	return SUCCESS;
+} // }}}
+
+ENCODER_FN(Bmp){ // {{{
+	uint8_t head[BMP_FILE_HEADER_SIZE + BMP_V4_HEADER_SIZE], *line, *dst;
+	size_t header, stride, size, x, y;
+	int bpp;
+	bool alpha;
+	Pixel *pixel;
+	ImageState ret;
+
+	// Opaque images are written as 24 bit, others as 32 bit with an alpha mask
+	alpha = input->type != SOLID;
+	bpp = alpha ? 32 : 24;
+	header = alpha ? BMP_V4_HEADER_SIZE : BMP_INFO_HEADER_SIZE;
+	stride = ((input->width * bpp + 31) / 32) * 4;
+	size = BMP_FILE_HEADER_SIZE + header + stride * input->height;
+	if(size > 0xFFFFFFFF) return FAIL;
+
+	memset(head, 0x00, sizeof(head));
+	head[0] = 'B';
+	head[1] = 'M';
+	BMP_SET32(head + 2, size);
+	BMP_SET32(head + 10, BMP_FILE_HEADER_SIZE + header);
+	BMP_SET32(head + 14, header);
+	BMP_SET32(head + 18, input->width);
+	BMP_SET32(head + 22, input->height);
+	BMP_SET16(head + 26, 1);
+	BMP_SET16(head + 28, bpp);
+	BMP_SET32(head + 30, alpha ? BMP_BITFIELDS : BMP_RGB);
+	BMP_SET32(head + 34, stride * input->height);
+	BMP_SET32(head + 38, BMP_PPM);
+	BMP_SET32(head + 42, BMP_PPM);
+	if(alpha){
+		BMP_SET32(head + 54, 0x00FF0000);
+		BMP_SET32(head + 58, 0x0000FF00);
+		BMP_SET32(head + 62, 0x000000FF);
+		BMP_SET32(head + 66, 0xFF000000);
+		BMP_SET32(head + 70, 0x73524742); // 'sRGB'
+	}
+
+	if((line = (uint8_t *) calloc(1, stride)) == NULL) return FAIL;
+
+	output->Estimate(size);
+	ret = output->Write(head, BMP_FILE_HEADER_SIZE + header);
+
+	// Bottom-up rows
+	for(y = input->height; y-- > 0 && ret == SUCCESS;){
+		pixel = input->data[y];
+		dst = line;
+		if(alpha){
+			for(x = 0; x < input->width; x++, dst += 4){
+				dst[0] = pixel[x].B;
+				dst[1] = pixel[x].G;
+				dst[2] = pixel[x].R;
+				dst[3] = pixel[x].A;
+			}
+		}else{
+			for(x = 0; x < input->width; x++, dst += 3){
+				dst[0] = pixel[x].B;
+				dst[1] = pixel[x].G;
+				dst[2] = pixel[x].R;
+			}
+		}
+		ret = output->Write(line, stride);
+	}
+
+	free(line);
+	return ret;
+} // }}}
 
 #endif
+
+// vim600: sw=4 ts=4 fdm=marker syn=cpp
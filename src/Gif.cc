@@ -54,50 +54,156 @@ int ReadFromMemory (GifFileType *gif, GifByteType *dst, int size){
 	return size;
 }
 
-void DrawImage2PixelArray(PixelArray* dst, GifRowType *rows, ColorMapObject *map, int transparent){
-	size_t x, y, w, h;
+// Palette of a frame, transparent and out of range entries have zero alpha
+void BuildFrameTable(Pixel *table, ColorMapObject *map, int transparent){
+	int i;
+	GifColorType *entry;
+
+	memset(table, 0x00, 256 * sizeof(Pixel));
+	for(i = 0, entry = map->Colors; i < map->ColorCount && i < 256; i++, entry++){
+		table[i].R = entry->Red;
+		table[i].G = entry->Green;
+		table[i].B = entry->Blue;
+		table[i].A = 0xFF;
+	}
+	if(transparent >= 0 && transparent < 256){
+		table[transparent].A = 0x00;
+	}
+}
 
-	w = dst->width;
-	h = dst->height;
-	Pixel *pixel;
-	GifColorType *colors, *entry;
-	GifPixelType id;
+// Composite a line of the frame, return how many transparent pixels were covered
+size_t DrawFrameLine(Pixel *dst, GifPixelType *line, size_t width, Pixel *table){
+	size_t x, covered;
+	Pixel *entry;
+
+	covered = 0;
+	for(x = 0; x < width; x++, dst++){
+		entry = &(table[line[x]]);
+		if(entry->A == 0x00) continue;
+		if(dst->A == 0x00) covered++;
+		*dst = *entry;
+	}
+	return covered;
+}
 
-	colors = map->Colors;
+static int InterlacedOffset[] =  { 0, 4, 2, 1 },
+		   InterlacedJumps[] =  { 8, 8, 4, 2 };
 
-	for(y = 0; y < h; y++){
-		for(x = 0; x < w; x++){
-			id = rows[y][x];
-			pixel = &(dst->data[y][x]);
-			if(transparent != -1 && transparent == id){
-				continue;
+// Graphic control state, applies to the next image only
+typedef struct {
+	int transparent;
+	uint32_t delay;
+	ImageDisposal disposal;
+	int loop;
+} GifControl;
+
+void ResetControl(GifControl *control){
+	control->transparent = -1;
+	control->delay = 0;
+	control->disposal = DISPOSE_NONE;
+}
+
+ImageState ReadExtension(GifFileType *gif, GifControl *control){ // {{{
+	int extcode;
+	bool netscape;
+	GifByteType *extension;
+
+	if(DGifGetExtension(gif, &extcode, &extension) == GIF_ERROR) return FAIL;
+
+	netscape = false;
+	switch(extcode){
+		case GRAPHICS_EXT_FUNC_CODE:
+			if(extension != NULL && extension[0] >= 4){
+				control->transparent = (extension[1] & 0x01) == 0x01 ? extension[4] : -1;
+				control->delay = (extension[2] | extension[3] << 8) * 10;
+				switch((extension[1] >> 2) & 0x07){
+					case 2:
+						control->disposal = DISPOSE_BACKGROUND;
+						break;
+					case 3:
+						control->disposal = DISPOSE_PREVIOUS;
+						break;
+					default:
+						control->disposal = DISPOSE_NONE;
+						break;
+				}
 			}
-			entry = &(colors[id]);
-			pixel->R = entry->Red;
-			pixel->G = entry->Green;
-			pixel->B = entry->Blue;
-			pixel->A = 0xFF;
+			break;
+		case APPLICATION_EXT_FUNC_CODE:
+			netscape = extension != NULL && extension[0] == 11 && memcmp(&extension[1], "NETSCAPE2.0", 11) == 0;
+			break;
+		case COMMENT_EXT_FUNC_CODE:
+		case PLAINTEXT_EXT_FUNC_CODE:
+		default:
+			break;
+	}
+
+	while(extension != NULL){
+		if(DGifGetExtensionNext(gif, &extension) == GIF_ERROR) return FAIL;
+		if(netscape && extension != NULL && extension[0] >= 3 && extension[1] == 0x01){
+			control->loop = extension[2] | extension[3] << 8;
 		}
 	}
-	dst->DetectTransparent();
-}
+	return SUCCESS;
+} // }}}
 
-static int InterlacedOffset[] =  { 0, 4, 2, 1 },
-		   InterlacedJumps[] =  { 8, 8, 4, 2 };
+// Decode the current image into its rectangle of the canvas
+ImageState DrawFrame(GifFileType *gif, PixelArray *output, GifPixelType *line, GifControl *control, size_t *covered){ // {{{
+	GifImageDesc *img;
+	ColorMapObject *map;
+	Pixel table[256];
+	GifWord i, x, y, w, h;
+	size_t count;
+
+	img = &(gif->Image);
+	x = img->Left;
+	y = img->Top;
+	w = img->Width;
+	h = img->Height;
+	//printf("(%d,%d,%d,%d)\n", x, y, w, h);
+
+	if(x < 0 || y < 0 || x + w > (GifWord) output->width || y + h > (GifWord) output->height) return FAIL;
+
+	if((map = img->ColorMap ? img->ColorMap : gif->SColorMap) == NULL) return FAIL;
+	BuildFrameTable(table, map, control->transparent);
+
+	if(img->Interlace){
+		for(count = 0; count < 4; count++)
+			for(i = InterlacedOffset[count]; i < h; i += InterlacedJumps[count]){
+				if(DGifGetLine(gif, line, w) == GIF_ERROR) return FAIL;
+				*covered += DrawFrameLine(&(output->data[y+i][x]), line, w, table);
+			}
+	}else{
+		for(i = 0; i < h; i++){
+			if(DGifGetLine(gif, line, w) == GIF_ERROR) return FAIL;
+			*covered += DrawFrameLine(&(output->data[y+i][x]), line, w, table);
+		}
+	}
+	return SUCCESS;
+} // }}}
+
+// Skip the compressed data of the current image without decoding it
+ImageState SkipFrame(GifFileType *gif){ // {{{
+	int size;
+	GifByteType *block;
+
+	if(DGifGetCode(gif, &size, &block) == GIF_ERROR) return FAIL;
+	while(block != NULL){
+		if(DGifGetCodeNext(gif, &block) == GIF_ERROR) return FAIL;
+	}
+	return SUCCESS;
+} // }}}
 
 DECODER_FN(Gif){
 	ImageState ret;
 
 	GifFileType *gif;
-	GifRowType  *rows, row;
+	GifPixelType *line;
 	GifRecordType type;
-	GifImageDesc *img;
-	ColorMapObject *map;
-	int extcode, transparent;
-	GifByteType *extension;
+	GifControl control;
 
-	GifWord width, height, i, x, y, w, h;
-	size_t size, count;
+	GifWord width, height;
+	size_t covered;
 
 	ret = FAIL;
 
@@ -106,31 +212,15 @@ DECODER_FN(Gif){
 	width = gif->SWidth;
 	height = gif->SHeight;
 	//printf("width:%d,height:%d\n", width, height);
+	if(Image::checkSize(width, height, options) != SUCCESS) goto CLOSE_GIF;
 
-	size = height * sizeof(GifRowType *);
-	if((rows = (GifRowType *) malloc(size)) == NULL) goto CLOSE_GIF;
-	memset(rows, 0x00, size);
-
-	size = width * sizeof(GifPixelType);
-	if ((row = (GifRowType) malloc(size)) == NULL) goto FREE_ROWS;
-
-	if(sizeof(GifPixelType) == 1){
-		memset(row, gif->SBackGroundColor, size);
-	}else{
-		for(i = 0; i < width; i++){
-			row[i] = gif->SBackGroundColor;
-		}
-	}
+	if((line = (GifPixelType *) malloc(width * sizeof(GifPixelType))) == NULL) goto CLOSE_GIF;
 
-	rows[0] = row;
+	if(output->Malloc(width, height) != SUCCESS) goto FREE_LINE;
+	ResetControl(&control);
 
-	for(i = 1; i < height; i++){
-		if((rows[i] = (GifRowType) malloc(size)) == NULL) goto FREE_ROWS;
-		memcpy(rows[i], row, size);
-	}
-
-	if(output->Malloc(width, height) != SUCCESS) goto FREE_ROWS;
-	transparent = -1;
+	// Canvas starts fully transparent, count the pixels frames cover
+	covered = 0;
 
 	do{
 		if (DGifGetRecordType(gif, &type) == GIF_ERROR) goto FREE_SCREEN;
@@ -138,59 +228,11 @@ DECODER_FN(Gif){
 		switch(type){
 			case IMAGE_DESC_RECORD_TYPE:
 				if (DGifGetImageDesc(gif) == GIF_ERROR) goto FREE_SCREEN;
-
-				img = &(gif->Image);
-				x = img->Left;
-				y = img->Top;
-				w = img->Width;
-				h = img->Height;
-				//printf("(%d,%d,%d,%d)\n", x, y, w, h);
-
-				if(x < 0 || y < 0 || x + w > width || y + h > height) goto FREE_SCREEN;
-
-				if(img->Interlace){
-					for(count = 0; count < 4; count++)
-						for(i = InterlacedOffset[count]; i < h; i += InterlacedJumps[count]){
-							if(DGifGetLine(gif, &rows[y+i][x], w) == GIF_ERROR) goto FREE_SCREEN;
-						}
-				}else{
-					for(i = 0; i < h; i++)
-						if(DGifGetLine(gif, &rows[y+i][x], w) == GIF_ERROR) goto FREE_SCREEN;
-				}
-
-				if((map = img->ColorMap ? img->ColorMap : gif->SColorMap) == NULL) goto FREE_SCREEN;
-				DrawImage2PixelArray(output, rows, map, transparent);
-
+				if (DrawFrame(gif, output, line, &control, &covered) != SUCCESS) goto FREE_SCREEN;
+				ResetControl(&control);
 				break;
 			case EXTENSION_RECORD_TYPE:
-				if(DGifGetExtension(gif, &extcode, &extension) == GIF_ERROR) goto FREE_SCREEN;
-				//printf("extcode:%X\n", extcode);
-				switch(extcode){
-					case COMMENT_EXT_FUNC_CODE:
-						break;
-					case GRAPHICS_EXT_FUNC_CODE:
-						if(extension != NULL){
-							if((extension[1] & 0x01) == 0x01){
-								transparent = extension[4];
-							}else{
-								transparent = -1;
-							}
-						}
-						break;
-					case PLAINTEXT_EXT_FUNC_CODE:
-						break;
-					case APPLICATION_EXT_FUNC_CODE:
-						break;
-				}
-				while(extension != NULL){
-					//int length = extension[0];
-					//printf("[");
-					//for(int i = 0; i <= length; i++)
-					//	printf("0x%02X,", extension[i]);
-					//printf("]\n");
-					if(DGifGetExtensionNext(gif, &extension) == GIF_ERROR) goto FREE_SCREEN;
-				}
-
+				if (ReadExtension(gif, &control) != SUCCESS) goto FREE_SCREEN;
 				break;
 			case TERMINATE_RECORD_TYPE:
 				// Do nothing
@@ -199,26 +241,29 @@ DECODER_FN(Gif){
 				// Should not happen
 			case UNDEFINED_RECORD_TYPE:
 			default:
-				goto FREE_ROWS;
+				goto FREE_SCREEN;
 				break;
 		}
 	}while(type != TERMINATE_RECORD_TYPE);
 
 	//printf("Record End!\n");
 
+	if(covered == (size_t) width * height){
+		output->type = SOLID;
+	}else if(covered == 0){
+		output->type = EMPTY;
+	}else{
+		output->type = ALPHA;
+	}
 
 	ret = SUCCESS;
-	goto FREE_ROWS;
+	goto FREE_LINE;
 
 FREE_SCREEN:
 	output->Free();
 
-FREE_ROWS:
-	for(i = 0; i < height; i++){
-		if(rows[i] != NULL)
-			free(rows[i]);
-	}
-	free(rows);
+FREE_LINE:
+	free(line);
 
 CLOSE_GIF:
 	DGifCloseFile(gif, NULL);
@@ -229,9 +274,494 @@ RETURN:
 	return ret;
 }
 
+ImageState FrameInfoGif(ImageAnimation *output, ImageData *input, ImageDecodeOptions *options){ // {{{
+	ImageState ret;
+
+	GifFileType *gif;
+	GifRecordType type;
+	GifControl control;
+	ImageFrame *frames, *frame;
+	size_t size;
+
+	ret = FAIL;
+
+	output->count = 0;
+	output->frames = NULL;
+	output->loop = -1;
+
+	input->position = 0;
+	if((gif = DGifOpen((void *) input, ReadFromMemory, NULL)) == NULL) goto RETURN;
+	output->width = gif->SWidth;
+	output->height = gif->SHeight;
+	if(Image::checkSize(output->width, output->height, options) != SUCCESS) goto CLOSE_GIF;
+
+	size = 0;
+	ResetControl(&control);
+	control.loop = -1;
+
+	do{
+		if(DGifGetRecordType(gif, &type) == GIF_ERROR) goto FREE_FRAMES;
+		switch(type){
+			case IMAGE_DESC_RECORD_TYPE:
+				if(DGifGetImageDesc(gif) == GIF_ERROR) goto FREE_FRAMES;
+				if(output->count == size){
+					size = size ? size * 2 : 16;
+					if((frames = (ImageFrame *) realloc(output->frames, size * sizeof(ImageFrame))) == NULL) goto FREE_FRAMES;
+					output->frames = frames;
+				}
+				frame = &(output->frames[output->count++]);
+				frame->x = gif->Image.Left;
+				frame->y = gif->Image.Top;
+				frame->width = gif->Image.Width;
+				frame->height = gif->Image.Height;
+				frame->delay = control.delay;
+				frame->disposal = control.disposal;
+				if(SkipFrame(gif) != SUCCESS) goto FREE_FRAMES;
+				ResetControl(&control);
+				break;
+			case EXTENSION_RECORD_TYPE:
+				if(ReadExtension(gif, &control) != SUCCESS) goto FREE_FRAMES;
+				break;
+			case TERMINATE_RECORD_TYPE:
+				break;
+			default:
+				goto FREE_FRAMES;
+				break;
+		}
+	}while(type != TERMINATE_RECORD_TYPE);
+
+	output->loop = control.loop;
+	ret = output->count > 0 ? SUCCESS : FAIL;
+	if(ret == SUCCESS) goto CLOSE_GIF;
+
+FREE_FRAMES:
+	free(output->frames);
+	output->frames = NULL;
+	output->count = 0;
+
+CLOSE_GIF:
+	DGifCloseFile(gif, NULL);
+
+RETURN:
+	return ret;
+} // }}}
+
+ImageState FrameDrawGif(PixelArray *output, ImageData *input, size_t index){ // {{{
+	ImageState ret;
+
+	GifFileType *gif;
+	GifPixelType *line;
+	GifRecordType type;
+	GifControl control;
+	size_t current, covered;
+
+	ret = FAIL;
+
+	input->position = 0;
+	if((gif = DGifOpen((void *) input, ReadFromMemory, NULL)) == NULL) goto RETURN;
+	if(output->data == NULL || (size_t) gif->SWidth != output->width || (size_t) gif->SHeight != output->height) goto CLOSE_GIF;
+	if((line = (GifPixelType *) malloc(gif->SWidth * sizeof(GifPixelType))) == NULL) goto CLOSE_GIF;
+
+	current = 0;
+	covered = 0;
+	ResetControl(&control);
+
+	do{
+		if(DGifGetRecordType(gif, &type) == GIF_ERROR) goto FREE_LINE;
+		switch(type){
+			case IMAGE_DESC_RECORD_TYPE:
+				if(DGifGetImageDesc(gif) == GIF_ERROR) goto FREE_LINE;
+				if(current++ < index){
+					// Frames before the wanted one are skipped, not decoded
+					if(SkipFrame(gif) != SUCCESS) goto FREE_LINE;
+					ResetControl(&control);
+					break;
+				}
+				if(DrawFrame(gif, output, line, &control, &covered) != SUCCESS) goto FREE_LINE;
+				if(covered > 0 && output->type != SOLID) output->DetectTransparent();
+				ret = SUCCESS;
+				goto FREE_LINE;
+			case EXTENSION_RECORD_TYPE:
+				if(ReadExtension(gif, &control) != SUCCESS) goto FREE_LINE;
+				break;
+			case TERMINATE_RECORD_TYPE:
+				break;
+			default:
+				goto FREE_LINE;
+				break;
+		}
+	}while(type != TERMINATE_RECORD_TYPE);
+
+FREE_LINE:
+	free(line);
+
+CLOSE_GIF:
+	DGifCloseFile(gif, NULL);
+
+RETURN:
+	return ret;
+} // }}}
+
+ImageFrameDecoder FRAME_DECODER(Gif) = {
+	FrameInfoGif,
+	FrameDrawGif,
+};
+
+typedef struct {
+	char G;
+	char I;
+	char F;
+	char _;
+	uint8_t colors; // palette size, 0 means 256
+	uint8_t dither; // ordered dithering
+} gif_compress_config;
+
+gif_compress_config default_gif_compress_config = {
+	'G','I','F',' ',
+	0,
+	0,
+};
+
+gif_compress_config *get_gif_compress_config(ImageConfig *config){ // {{{
+	if(config == NULL || config->data == NULL
+	|| config->length != sizeof(gif_compress_config)
+	|| config->data[0] != default_gif_compress_config.G
+	|| config->data[1] != default_gif_compress_config.I
+	|| config->data[2] != default_gif_compress_config.F
+	|| config->data[3] != default_gif_compress_config._)
+		return &default_gif_compress_config;
+
+	return (gif_compress_config *) config->data;
+} // }}}
+
+int WriteToMemory(GifFileType *gif, const GifByteType *src, int size){ // {{{
+	ImageData *data;
+
+	if(!gif->UserData) return 0;
+
+	data = (ImageData *) gif->UserData;
+	if(data->Write(src, size) != SUCCESS) return 0;
+	return size;
+} // }}}
+
+#define GIF_PALETTE_SIZE 256
+#define GIF_ALPHA_THRESHOLD 0x80
+#define GIF_HASH_BITS 10
+#define GIF_HASH_SIZE (1 << GIF_HASH_BITS)
+#define GIF_HIST_SIZE 32768
+#define GIF_MAP_EMPTY 0xFFFF
+#define GIF_RGB555(r, g, b) ((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3))
+
+typedef struct {
+	uint8_t lo[3];
+	uint8_t hi[3];
+	uint32_t count;
+} GifBox;
+
+typedef struct {
+	int colors;       // palette entries in use
+	int transparent;  // transparent index, -1 if none
+	bool exact;       // every color has its own entry
+	bool dither;
+	GifColorType palette[GIF_PALETTE_SIZE];
+
+	// exact palette lookup
+	uint32_t keys[GIF_HASH_SIZE];
+	int16_t index[GIF_HASH_SIZE];
+
+	// median cut, RGB555 histogram and its lazily filled inverse map
+	uint32_t hist[GIF_HIST_SIZE];
+	uint16_t map[GIF_HIST_SIZE];
+	GifBox boxes[GIF_PALETTE_SIZE];
+} GifQuantizer;
+
+static const int8_t GifBayer[4][4] = {
+	{ -15,   1, -11,   5 },
+	{   9,  -7,  13,  -3 },
+	{  -9,   7, -13,   3 },
+	{  15,  -1,  11,  -5 },
+};
+
+inline uint32_t GifPixelKey(Pixel *pixel){
+	return (uint32_t) pixel->R << 16 | pixel->G << 8 | pixel->B;
+}
+
+inline int16_t *GifExactSlot(GifQuantizer *q, uint32_t key){ // {{{
+	uint32_t slot;
+
+	slot = (key * 2654435761U) >> (32 - GIF_HASH_BITS);
+	while(q->index[slot] != -1 && q->keys[slot] != key){
+		slot = (slot + 1) & (GIF_HASH_SIZE - 1);
+	}
+	q->keys[slot] = key;
+	return &(q->index[slot]);
+} // }}}
+
+void GifBoxShrink(GifQuantizer *q, GifBox *box){ // {{{
+	int r, g, b, lo[3], hi[3];
+	uint32_t count, n;
+
+	lo[0] = lo[1] = lo[2] = 31;
+	hi[0] = hi[1] = hi[2] = 0;
+	count = 0;
+
+	for(r = box->lo[0]; r <= box->hi[0]; r++)
+		for(g = box->lo[1]; g <= box->hi[1]; g++)
+			for(b = box->lo[2]; b <= box->hi[2]; b++){
+				if((n = q->hist[(r << 10) | (g << 5) | b]) == 0) continue;
+				count += n;
+				if(r < lo[0]) lo[0] = r;
+				if(r > hi[0]) hi[0] = r;
+				if(g < lo[1]) lo[1] = g;
+				if(g > hi[1]) hi[1] = g;
+				if(b < lo[2]) lo[2] = b;
+				if(b > hi[2]) hi[2] = b;
+			}
+
+	box->count = count;
+	if(count > 0){
+		for(r = 0; r < 3; r++){
+			box->lo[r] = lo[r];
+			box->hi[r] = hi[r];
+		}
+	}
+} // }}}
+
+int GifMedianCut(GifQuantizer *q, int max){ // {{{
+	GifBox *box, *next;
+	uint32_t proj[32], sum;
+	int n, i, best, axis, side, c[3], cut;
+
+	box = &(q->boxes[0]);
+	box->lo[0] = box->lo[1] = box->lo[2] = 0;
+	box->hi[0] = box->hi[1] = box->hi[2] = 31;
+	GifBoxShrink(q, box);
+	if(box->count == 0) return 0;
+
+	for(n = 1; n < max; n++){
+		// Split the most populated box that still spans more than one bin
+		best = -1;
+		for(i = 0; i < n; i++){
+			box = &(q->boxes[i]);
+			if(box->lo[0] == box->hi[0] && box->lo[1] == box->hi[1] && box->lo[2] == box->hi[2]) continue;
+			if(best == -1 || box->count > q->boxes[best].count) best = i;
+		}
+		if(best == -1) break;
+
+		box = &(q->boxes[best]);
+		axis = 0;
+		for(i = 1; i < 3; i++){
+			if(box->hi[i] - box->lo[i] > box->hi[axis] - box->lo[axis]) axis = i;
+		}
+
+		memset(proj, 0, sizeof(proj));
+		for(c[0] = box->lo[0]; c[0] <= box->hi[0]; c[0]++)
+			for(c[1] = box->lo[1]; c[1] <= box->hi[1]; c[1]++)
+				for(c[2] = box->lo[2]; c[2] <= box->hi[2]; c[2]++)
+					proj[c[axis]] += q->hist[(c[0] << 10) | (c[1] << 5) | c[2]];
+
+		sum = 0;
+		side = box->hi[axis];
+		for(cut = box->lo[axis]; cut < side - 1; cut++){
+			sum += proj[cut];
+			if(sum * 2 >= box->count) break;
+		}
+
+		next = &(q->boxes[n]);
+		*next = *box;
+		box->hi[axis] = cut;
+		next->lo[axis] = cut + 1;
+		GifBoxShrink(q, box);
+		GifBoxShrink(q, next);
+	}
+
+	for(i = 0; i < n; i++){
+		uint64_t sums[3] = {0, 0, 0};
+		uint32_t count;
+
+		box = &(q->boxes[i]);
+		for(c[0] = box->lo[0]; c[0] <= box->hi[0]; c[0]++)
+			for(c[1] = box->lo[1]; c[1] <= box->hi[1]; c[1]++)
+				for(c[2] = box->lo[2]; c[2] <= box->hi[2]; c[2]++){
+					count = q->hist[(c[0] << 10) | (c[1] << 5) | c[2]];
+					sums[0] += (uint64_t) count * ((c[0] << 3) | 4);
+					sums[1] += (uint64_t) count * ((c[1] << 3) | 4);
+					sums[2] += (uint64_t) count * ((c[2] << 3) | 4);
+				}
+		q->palette[i].Red = (GifByteType) (sums[0] / box->count);
+		q->palette[i].Green = (GifByteType) (sums[1] / box->count);
+		q->palette[i].Blue = (GifByteType) (sums[2] / box->count);
+	}
+	return n;
+} // }}}
+
+ImageState GifQuantize(PixelArray *input, GifQuantizer *q, int max, bool dither){ // {{{
+	size_t x, y;
+	Pixel *pixel;
+	int16_t *index;
+	bool transparent;
+
+	transparent = false;
+	q->colors = 0;
+	q->exact = true;
+	q->dither = dither;
+	memset(q->index, 0xFF, sizeof(q->index));
+	memset(q->hist, 0x00, sizeof(q->hist));
+	memset(q->palette, 0x00, sizeof(q->palette));
+
+	for(y = 0; y < input->height; y++){
+		pixel = input->data[y];
+		for(x = 0; x < input->width; x++, pixel++){
+			if(pixel->A < GIF_ALPHA_THRESHOLD){
+				transparent = true;
+				continue;
+			}
+			q->hist[GIF_RGB555(pixel->R, pixel->G, pixel->B)]++;
+			if(q->exact){
+				index = GifExactSlot(q, GifPixelKey(pixel));
+				if(*index == -1){
+					if(q->colors == GIF_PALETTE_SIZE){
+						q->exact = false;
+						continue;
+					}
+					*index = q->colors;
+					q->palette[q->colors].Red = pixel->R;
+					q->palette[q->colors].Green = pixel->G;
+					q->palette[q->colors].Blue = pixel->B;
+					q->colors++;
+				}
+			}
+		}
+	}
+
+	// Keep the last entry for transparent pixels
+	if(transparent) max--;
+
+	if(!q->exact || q->colors > max){
+		q->exact = false;
+		q->colors = GifMedianCut(q, max);
+		memset(q->map, 0xFF, sizeof(q->map));
+	}
+
+	q->transparent = -1;
+	if(transparent){
+		q->transparent = q->colors++;
+	}
+
+	return q->colors > 0 ? SUCCESS : FAIL;
+} // }}}
+
+inline GifPixelType GifNearest(GifQuantizer *q, int key){ // {{{
+	int i, r, g, b, dr, dg, db, dist, best, nearest, n;
+	GifColorType *color;
+
+	if(q->map[key] != GIF_MAP_EMPTY) return (GifPixelType) q->map[key];
+
+	r = ((key >> 10) << 3) | 4;
+	g = (((key >> 5) & 0x1F) << 3) | 4;
+	b = ((key & 0x1F) << 3) | 4;
+
+	n = q->transparent == -1 ? q->colors : q->colors - 1;
+	nearest = 0;
+	best = 0x7FFFFFFF;
+	for(i = 0, color = q->palette; i < n; i++, color++){
+		dr = r - color->Red;
+		dg = g - color->Green;
+		db = b - color->Blue;
+		dist = dr * dr + dg * dg + db * db;
+		if(dist < best){
+			best = dist;
+			nearest = i;
+		}
+	}
+	q->map[key] = nearest;
+	return (GifPixelType) nearest;
+} // }}}
+
+inline int GifClamp(int v){
+	return v < 0 ? 0 : (v > 0xFF ? 0xFF : v);
+}
+
+void GifQuantizeRow(GifQuantizer *q, Pixel *pixel, GifPixelType *line, size_t width, size_t y){ // {{{
+	size_t x;
+	int d;
+	const int8_t *bayer;
+
+	bayer = GifBayer[y & 3];
+	for(x = 0; x < width; x++, pixel++, line++){
+		if(pixel->A < GIF_ALPHA_THRESHOLD){
+			*line = q->transparent;
+		}else if(q->exact){
+			*line = (GifPixelType) *GifExactSlot(q, GifPixelKey(pixel));
+		}else if(q->dither){
+			d = bayer[x & 3];
+			*line = GifNearest(q, GIF_RGB555(GifClamp(pixel->R + d), GifClamp(pixel->G + d), GifClamp(pixel->B + d)));
+		}else{
+			*line = GifNearest(q, GIF_RGB555(pixel->R, pixel->G, pixel->B));
+		}
+	}
+} // }}}
+
 ENCODER_FN(Gif){
-	//TODO
-	return FAIL;
+	ImageState ret;
+
+	gif_compress_config *conf;
+	GifQuantizer *q;
+	GifFileType *gif;
+	ColorMapObject *map;
+	GifPixelType *line;
+	GifByteType extension[4];
+	int error, size, max;
+	size_t y;
+
+	ret = FAIL;
+	conf = get_gif_compress_config(config);
+	max = conf->colors == 0 ? GIF_PALETTE_SIZE : (conf->colors < 2 ? 2 : conf->colors);
+
+	if((q = (GifQuantizer *) malloc(sizeof(GifQuantizer))) == NULL) goto RETURN;
+	if(GifQuantize(input, q, max, conf->dither != 0) != SUCCESS) goto FREE_QUANTIZER;
+	if((line = (GifPixelType *) malloc(input->width * sizeof(GifPixelType))) == NULL) goto FREE_QUANTIZER;
+
+	// Color map size must be a power of two
+	for(size = 2; size < q->colors; size <<= 1);
+	if((map = GifMakeMapObject(size, q->palette)) == NULL) goto FREE_LINE;
+
+	if((gif = EGifOpen((void *) output, WriteToMemory, &error)) == NULL) goto FREE_MAP;
+	EGifSetGifVersion(gif, true);
+
+	if(EGifPutScreenDesc(gif, input->width, input->height, map->BitsPerPixel, 0, map) == GIF_ERROR) goto CLOSE_GIF;
+
+	if(q->transparent != -1){
+		extension[0] = 0x01; // transparent color flag
+		extension[1] = 0x00; // delay
+		extension[2] = 0x00;
+		extension[3] = q->transparent;
+		if(EGifPutExtension(gif, GRAPHICS_EXT_FUNC_CODE, 4, extension) == GIF_ERROR) goto CLOSE_GIF;
+	}
+
+	if(EGifPutImageDesc(gif, 0, 0, input->width, input->height, false, NULL) == GIF_ERROR) goto CLOSE_GIF;
+
+	for(y = 0; y < input->height; y++){
+		GifQuantizeRow(q, input->data[y], line, input->width, y);
+		if(EGifPutLine(gif, line, input->width) == GIF_ERROR) goto CLOSE_GIF;
+	}
+
+	ret = SUCCESS;
+
+CLOSE_GIF:
+	if(EGifCloseFile(gif, &error) == GIF_ERROR) ret = FAIL;
+
+FREE_MAP:
+	GifFreeMapObject(map);
+
+FREE_LINE:
+	free(line);
+
+FREE_QUANTIZER:
+	free(q);
+
+RETURN:
+	return ret;
 }
 
 #endif
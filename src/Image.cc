@@ -34,12 +34,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <uv.h>
 #include <iostream>
 
+using v8::Array;
 using v8::Exception;
+using v8::External;
 using v8::Function;
 using v8::FunctionCallbackInfo;
 using v8::FunctionTemplate;
+using v8::HandleScope;
 using v8::Isolate;
 using v8::Local;
 using v8::MaybeLocal;
@@ -70,6 +74,10 @@ using v8::Value;
 #define DEFAULT_WIDTH_LIMIT 10240  // default limit 10000x10000
 #define DEFAULT_HEIGHT_LIMIT 10240 // default limit 10000x10000
 
+#define OUTPUT_INIT_SIZE 4096
+#define OUTPUT_CHUNK_SIZE 16384
+#define STREAM_QUEUE_SIZE 4 // chunks an encodeStream encoder may run ahead of the reader
+
 #define AdjustAmountOfExternalAllocatedMemory(bc) static_cast<int>( \
     v8::Isolate::GetCurrent()->AdjustAmountOfExternalAllocatedMemory(bc));
 
@@ -77,10 +85,13 @@ Persistent<Function> Image::constructor;
 
 //size_t Image::survival;
 ImageCodec *Image::codecs;
+int Image::externalType = TYPE_EXTERNAL;
 
 size_t Image::maxWidth = DEFAULT_WIDTH_LIMIT;
 size_t Image::maxHeight = DEFAULT_HEIGHT_LIMIT;
-const char *Image::error = NULL;
+size_t Image::maxPixels = 0;
+size_t Image::maxBytes = 0;
+thread_local const char *Image::error = NULL;
 
 void Image::Init(Local<Object> exports)
 { // {{{
@@ -104,6 +115,13 @@ void Image::Init(Local<Object> exports)
     NODE_SET_PROTOTYPE_METHOD(tpl, "copyFromImage", CopyFromImage);
     NODE_SET_PROTOTYPE_METHOD(tpl, "drawImage", DrawImage);
     NODE_SET_PROTOTYPE_METHOD(tpl, "toBuffer", ToBuffer);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeMany", EncodeMany);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "encodeStream", EncodeStream);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "decodeChunk", DecodeChunk);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "decodeEnd", DecodeEnd);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "getFrames", GetFrames);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "drawFrame", DrawFrame);
+    NODE_SET_PROTOTYPE_METHOD(tpl, "clearRect", ClearRect);
 
     proto->SetAccessor(String::NewFromUtf8(isolate, "width"), GetWidth, SetWidth);
     proto->SetAccessor(String::NewFromUtf8(isolate, "height"), GetHeight, SetHeight);
@@ -117,11 +135,18 @@ void Image::Init(Local<Object> exports)
     NODE_DEFINE_CONSTANT(exports, TYPE_BMP);
     NODE_DEFINE_CONSTANT(exports, TYPE_RAW);
     NODE_DEFINE_CONSTANT(exports, TYPE_WEBP);
+    NODE_DEFINE_CONSTANT(exports, TYPE_QOI);
 
     exports->SetAccessor(String::NewFromUtf8(isolate, "maxWidth"), GetMaxWidth, SetMaxWidth);
     exports->SetAccessor(String::NewFromUtf8(isolate, "maxHeight"), GetMaxHeight, SetMaxHeight);
+    exports->SetAccessor(String::NewFromUtf8(isolate, "maxPixels"), GetMaxPixels, SetMaxPixels);
+    exports->SetAccessor(String::NewFromUtf8(isolate, "maxBytes"), GetMaxBytes, SetMaxBytes);
     exports->SetAccessor(String::NewFromUtf8(isolate, "usedMemory"), GetUsedMemory);
     NODE_SET_METHOD(exports, "gc", GC);
+    NODE_SET_METHOD(exports, "loadCodec", LoadCodec);
+#ifdef HAVE_JPEG
+    NODE_SET_METHOD(exports, "jpegTransform", JpegTransform);
+#endif
     exports->Set(String::NewFromUtf8(isolate, "Image"), tpl->GetFunction());
 
 } //}}}
@@ -168,6 +193,50 @@ void Image::SetMaxHeight(Local<String> property, Local<Value> value, const Prope
         maxHeight = value->Uint32Value();
 } // }}}
 
+void Image::GetMaxPixels(Local<String> property, const PropertyCallbackInfo<Value> &args)
+{ // {{{
+    Isolate *isolate = args.GetIsolate();
+    args.GetReturnValue().Set(Number::New(isolate, maxPixels));
+} // }}}
+
+void Image::SetMaxPixels(Local<String> property, Local<Value> value, const PropertyCallbackInfo<void> &args)
+{ // {{{
+    if (value->IsNumber())
+        maxPixels = value->Uint32Value();
+} // }}}
+
+void Image::GetMaxBytes(Local<String> property, const PropertyCallbackInfo<Value> &args)
+{ // {{{
+    Isolate *isolate = args.GetIsolate();
+    args.GetReturnValue().Set(Number::New(isolate, maxBytes));
+} // }}}
+
+void Image::SetMaxBytes(Local<String> property, Local<Value> value, const PropertyCallbackInfo<void> &args)
+{ // {{{
+    if (value->IsNumber())
+        maxBytes = value->Uint32Value();
+} // }}}
+
+ImageState Image::checkSize(size_t width, size_t height, ImageDecodeOptions *options)
+{ // {{{
+    size_t pixels, bytes;
+
+    pixels = options != NULL && options->max_pixels > 0 ? options->max_pixels : maxPixels;
+    bytes = options != NULL && options->max_bytes > 0 ? options->max_bytes : maxBytes;
+
+    if (width > maxWidth || height > maxHeight)
+        return setError("Beyond the pixel size limit.");
+
+    // Divide instead of multiplying, header sizes can overflow
+    if (width == 0 || height == 0)
+        return SUCCESS;
+    if (pixels > 0 && width > pixels / height)
+        return setError("Beyond the pixel count limit.");
+    if (bytes > 0 && width > bytes / sizeof(Pixel) / height)
+        return setError("Beyond the memory limit.");
+    return SUCCESS;
+} // }}}
+
 // Memory
 size_t Image::usedMemory = 0;
 
@@ -276,7 +345,7 @@ void Image::Resize(const FunctionCallbackInfo<Value> &args)
     }
 
     Image *img = node::ObjectWrap::Unwrap<Image>(args.This());
-    img->pixels->Resize(args[0]->ToNumber()->Value(), args[1]->ToNumber()->Value(), filter);
+    img->pixels->Resize(args[0]->ToNumber()->Value(), args[1]->ToNumber()->Value(), filter, !args[3]->IsFalse());
 
     args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
 }
@@ -337,6 +406,12 @@ void Image::FillColor(const FunctionCallbackInfo<Value> &args)
     args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
 } // }}}
 
+static size_t getSizeOption(Local<Object> obj, const char *name)
+{ // {{{
+    Local<Value> value = obj->Get(String::NewFromUtf8(Isolate::GetCurrent(), name));
+    return value->IsNumber() ? value->Uint32Value() : 0;
+} // }}}
+
 void Image::LoadFromBuffer(const FunctionCallbackInfo<Value> &args)
 { // {{{
 
@@ -346,8 +421,9 @@ void Image::LoadFromBuffer(const FunctionCallbackInfo<Value> &args)
     unsigned start, end, length;
 
     ImageCodec *codec;
-    ImageDecoder decoder;
     ImageData input_data, *input;
+    ImageDecodeOptions options_data, *options;
+    Local<Object> obj;
 
     if (!node::Buffer::HasInstance(args[0]))
     {
@@ -380,15 +456,43 @@ void Image::LoadFromBuffer(const FunctionCallbackInfo<Value> &args)
     input = &input_data;
     input->data = &buffer[start];
     input->length = end - start;
+    input->fixed = false;
+    input->flush = NULL;
+    input->context = NULL;
+
+    options = NULL;
+    if (args[3]->IsObject())
+    {
+        obj = args[3]->ToObject();
+        options = &options_data;
+        options->crop_x = getSizeOption(obj, "cropX");
+        options->crop_y = getSizeOption(obj, "cropY");
+        options->crop_width = getSizeOption(obj, "cropWidth");
+        options->crop_height = getSizeOption(obj, "cropHeight");
+        options->width = getSizeOption(obj, "width");
+        options->height = getSizeOption(obj, "height");
+        options->auto_orient = obj->Get(String::NewFromUtf8(Isolate::GetCurrent(), "autoOrient"))->BooleanValue();
+        options->thumbnail = obj->Get(String::NewFromUtf8(Isolate::GetCurrent(), "thumbnail"))->BooleanValue();
+        options->max_pixels = getSizeOption(obj, "maxPixels");
+        options->max_bytes = getSizeOption(obj, "maxBytes");
+    }
 
+    img->closeStream();
     img->pixels->Free();
     codec = codecs;
     while (codec != NULL && !isError())
     {
-        decoder = codec->decoder;
         input->position = 0;
-        if (decoder != NULL && decoder(img->pixels, input) == SUCCESS)
+        if (options != NULL)
+            options->handled = options->cropped = false;
+        if (codec->CanDecode() && codec->Decode(img->pixels, input, options) == SUCCESS)
         {
+            if (options != NULL && options->Apply(img->pixels) != SUCCESS)
+            {
+                img->pixels->Free();
+                THROW_GET_ERROR();
+                return;
+            }
             args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
             return;
         }
@@ -464,6 +568,34 @@ void Image::DrawImage(const FunctionCallbackInfo<Value> &args)
     args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
 } // }}}
 
+typedef struct {
+    Isolate *isolate;
+    Local<Function> callback;
+    bool aborted;
+} ToBufferStream;
+
+ImageState ToBufferFlush(void *context, const uint8_t *data, size_t length)
+{ // {{{
+    ToBufferStream *stream;
+    Local<Object> chunk;
+    Local<Value> argv[1];
+
+    stream = (ToBufferStream *)context;
+    if (!node::Buffer::Copy(stream->isolate, (const char *)data, length).ToLocal(&chunk))
+    {
+        return SET_ERROR("Out of memory.");
+    }
+
+    argv[0] = chunk;
+    if (stream->callback->Call(stream->isolate->GetCurrentContext(), v8::Null(stream->isolate), 1, argv).IsEmpty())
+    {
+        // Callback threw, leave the exception pending and stop encoding
+        stream->aborted = true;
+        return FAIL;
+    }
+    return SUCCESS;
+} // }}}
+
 void Image::ToBuffer(const FunctionCallbackInfo<Value> &args)
 { //{{{
 
@@ -472,13 +604,14 @@ void Image::ToBuffer(const FunctionCallbackInfo<Value> &args)
     PixelArray *pixels;
     ImageConfig _config, *config;
     ImageCodec *codec;
-    ImageEncoder encoder;
 
     ImageData output_data, *output;
+    ToBufferStream stream;
 
     Local<Object> buffer;
 
-    int length;
+    uint8_t *data;
+    size_t length;
 
     if (!args[0]->IsNumber())
     {
@@ -505,29 +638,73 @@ void Image::ToBuffer(const FunctionCallbackInfo<Value> &args)
         output->data = NULL;
         output->length = 0;
         output->position = 0;
+        output->fixed = false;
+        output->flush = NULL;
+        output->context = NULL;
+
+        if (node::Buffer::HasInstance(args[2]))
+        {
+            // Encode into the caller's buffer
+            output->data = (uint8_t *)node::Buffer::Data(args[2]);
+            output->length = node::Buffer::Length(args[2]);
+            output->fixed = true;
+        }
+        else if (args[2]->IsFunction())
+        {
+            stream.isolate = args.GetIsolate();
+            stream.callback = Local<Function>::Cast(args[2]);
+            stream.aborted = false;
+            output->flush = ToBufferFlush;
+            output->context = &stream;
+        }
 
         while (codec != NULL && !isError())
         {
             if (codec->type == type)
             {
-                encoder = codec->encoder;
-                if (encoder != NULL)
+                if (codec->CanEncode())
                 {
-                    if (encoder(pixels, output, config) == SUCCESS)
+                    if (codec->Encode(pixels, output, config) == SUCCESS)
                     {
+                        if (output->fixed)
+                        {
+                            args.GetReturnValue().Set(Number::New(args.GetIsolate(), output->position));
+                            return;
+                        }
+
+                        if (output->flush != NULL)
+                        {
+                            output->Flush();
+                            free(output->data);
+                            if (isError())
+                                THROW_GET_ERROR();
+                            return;
+                        }
+
+                        // Hand the encoded memory over to the Buffer, no copy
                         length = output->position;
-                        MaybeLocal<Object> maybeBuffer = node::Buffer::New(args.GetIsolate(), (size_t)length);
-                        maybeBuffer.ToLocal(&buffer);
-                        memcpy(node::Buffer::Data(buffer), output->data, length);
-                        free(output->data);
+                        data = length > 0 ? (uint8_t *)realloc(output->data, length) : NULL;
+                        if (data == NULL)
+                        {
+                            free(output->data);
+                            THROW_ERROR("Encode fail.");
+                            return;
+                        }
+                        if (!node::Buffer::New(args.GetIsolate(), (char *)data, length).ToLocal(&buffer))
+                        {
+                            THROW_ERROR("Out of memory.");
+                            return;
+                        }
                         args.GetReturnValue().Set(buffer);
                         return;
                     }
                     else
                     {
-                        if (output->data != NULL)
+                        if (!output->fixed)
                             free(output->data);
-                        THROW_ERROR("Encode fail.");
+                        if (output->flush != NULL && stream.aborted)
+                            return;
+                        isError() ? (THROW_GET_ERROR()) : (THROW_ERROR("Encode fail."));
                         return;
                     }
                 }
@@ -549,187 +726,1497 @@ void Image::ToBuffer(const FunctionCallbackInfo<Value> &args)
 
 } // }}}
 
-void Image::regCodec(ImageDecoder decoder, ImageEncoder encoder, ImageType type)
-{ // {{{
+struct EncodeBatch;
+
+// One output of encodeMany, encoded on the libuv thread pool
+typedef struct {
+    uv_work_t request;
+    struct EncodeBatch *batch;
     ImageCodec *codec;
-    codec = (ImageCodec *)malloc(sizeof(ImageCodec));
-    codec->next = codecs;
-    codec->decoder = decoder;
-    codec->encoder = encoder;
-    codec->type = type;
-    codecs = codec;
-} // }}}
+    ImageConfig config; // own copy, data is NULL if none
+    ImageData output;
+    ImageState state;
+    const char *error;
+} EncodeJob;
+
+typedef struct EncodeBatch {
+    // Snapshot of the image, read by every job and freed after the last one
+    PixelArray pixels;
+    Persistent<Function> callback;
+    Persistent<Object> resource; // async_hooks resource of the batch
+    node::async_context context;
+    EncodeJob *jobs;
+    size_t count;
+    size_t pending;
+} EncodeBatch;
+
+void Image::EncodeMany(const FunctionCallbackInfo<Value> &args)
+{ //{{{
+    Isolate *isolate = args.GetIsolate();
 
-Image::Image()
-{ // {{{
-    size_t size;
-    pixels = (PixelArray *)malloc(sizeof(PixelArray));
-    pixels->width = pixels->height = 0;
-    pixels->type = EMPTY;
-    pixels->data = NULL;
-    size = sizeof(PixelArray) + sizeof(Image);
-    AdjustAmountOfExternalAllocatedMemory(size);
-    usedMemory += size;
-    //survival++;
-} // }}}
+    Image *img;
+    Local<Array> types, configs;
+    Local<Value> config;
+    Local<Object> resource;
+    EncodeBatch *batch;
+    EncodeJob *job;
+    ImageCodec *codec;
+    ImageType type;
+    size_t i, count;
 
-Image::~Image()
-{ // {{{
-    int32_t size;
-    size = sizeof(PixelArray) + sizeof(Image);
-    pixels->Free();
-    free(pixels);
-    AdjustAmountOfExternalAllocatedMemory(-size);
-    usedMemory -= size;
-    //survival--;
-    //printf("survival:%d\n", survival);
+    if (!args[0]->IsArray() || !args[1]->IsArray() || !args[2]->IsFunction() || Local<Array>::Cast(args[0])->Length() == 0)
+    {
+        THROW_INVALID_ARGUMENTS_ERROR("");
+        return;
+    }
+
+    types = Local<Array>::Cast(args[0]);
+    configs = Local<Array>::Cast(args[1]);
+    count = types->Length();
+
+    img = node::ObjectWrap::Unwrap<Image>(args.This());
+    if (img->pixels->data == NULL)
+    {
+        THROW_ERROR("Image uninitialized.");
+        return;
+    }
+
+    batch = new EncodeBatch();
+    batch->pixels.data = NULL;
+    batch->count = batch->pending = count;
+    batch->jobs = (EncodeJob *)calloc(count, sizeof(EncodeJob));
+    if (batch->jobs == NULL || batch->pixels.CopyFrom(img->pixels, 0, 0, img->pixels->width, img->pixels->height) != SUCCESS)
+    {
+        free(batch->jobs);
+        delete batch;
+        THROW_ERROR("Out of memory.");
+        return;
+    }
+
+    // Pick the codecs and copy the configs up front, so a bad type fails before any work starts
+    for (i = 0; i < count; i++)
+    {
+        job = &batch->jobs[i];
+        job->batch = batch;
+        job->request.data = job;
+
+        type = (ImageType)types->Get(i)->Uint32Value();
+        for (codec = codecs; codec != NULL && codec->type != type; codec = codec->next)
+            ;
+        job->codec = codec;
+        if (codec == NULL || !codec->CanEncode())
+            break;
+
+        config = configs->Get(i);
+        if (node::Buffer::HasInstance(config))
+        {
+            job->config.length = node::Buffer::Length(config);
+            job->config.data = (char *)malloc(job->config.length > 0 ? job->config.length : 1);
+            if (job->config.data == NULL)
+                break;
+            memcpy(job->config.data, node::Buffer::Data(config), job->config.length);
+        }
+    }
+
+    if (i < count)
+    {
+        for (count = i + 1; count-- > 0;)
+            free(batch->jobs[count].config.data);
+        batch->pixels.Free();
+        free(batch->jobs);
+        delete batch;
+        if (job->codec == NULL)
+            THROW_ERROR("Unsupported type.");
+        else if (!job->codec->CanEncode())
+            THROW_ERROR("Can't encode to this format.");
+        else
+            THROW_ERROR("Out of memory.");
+        return;
+    }
+
+    batch->callback.Reset(isolate, Local<Function>::Cast(args[2]));
+    resource = Object::New(isolate);
+    batch->resource.Reset(isolate, resource);
+    batch->context = node::EmitAsyncInit(isolate, resource, "images:encodeMany");
+    for (i = 0; i < count; i++)
+    {
+        uv_queue_work(uv_default_loop(), &batch->jobs[i].request, EncodeManyWork, EncodeManyAfter);
+    }
 } // }}}
 
-void Pixel::Merge(Pixel *pixel)
+void Image::EncodeManyWork(uv_work_t *request)
 { // {{{
-    double a, af, ab;
-    ab = (double)A / 0xFF;
-    af = (double)pixel->A / 0xFF;
-    a = (1 - (1 - af) * (1 - ab));
+    EncodeJob *job;
 
-    R = (uint8_t)((pixel->R * af + R * ab * (1 - af)) / a);
-    G = (uint8_t)((pixel->G * af + G * ab * (1 - af)) / a);
-    B = (uint8_t)((pixel->B * af + B * ab * (1 - af)) / a);
-    A = (uint8_t)(a * 0xFF);
+    // Runs on a pool thread, error is thread local
+    job = (EncodeJob *)request->data;
+    job->state = job->codec->Encode(&job->batch->pixels, &job->output, job->config.data != NULL ? &job->config : NULL);
+    job->error = error;
+    error = NULL;
 } // }}}
 
-ImageState PixelArray::Malloc(size_t w, size_t h)
+void Image::EncodeManyAfter(uv_work_t *request, int status)
 { // {{{
-    int32_t size;
-    Pixel *line;
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
 
-    if (w > 0 && h > 0)
+    EncodeBatch *batch;
+    EncodeJob *job, *failed;
+    node::async_context context;
+    Local<Array> buffers;
+    Local<Object> buffer;
+    Local<Value> argv[2];
+    uint8_t *data;
+    size_t i, length;
+
+    job = (EncodeJob *)request->data;
+    batch = job->batch;
+    if (status != 0)
     {
-        if (w > Image::maxWidth || h > Image::maxHeight)
+        job->state = FAIL;
+        job->error = "Encode canceled.";
+    }
+    if (--batch->pending > 0)
+        return;
+
+    failed = NULL;
+    for (i = 0; i < batch->count && failed == NULL; i++)
+    {
+        if (batch->jobs[i].state != SUCCESS)
+            failed = &batch->jobs[i];
+    }
+
+    buffers = Array::New(isolate, batch->count);
+    for (i = 0; i < batch->count; i++)
+    {
+        job = &batch->jobs[i];
+        free(job->config.data);
+        if (failed != NULL)
         {
-            SET_ERROR("Beyond the pixel size limit.");
-            goto fail;
+            free(job->output.data);
+            continue;
         }
 
-        if ((data = (Pixel **)malloc(h * sizeof(Pixel **))) == NULL)
+        // Hand the encoded memory over to the Buffer, no copy
+        length = job->output.position;
+        data = length > 0 ? (uint8_t *)realloc(job->output.data, length) : NULL;
+        if (data == NULL)
         {
-            SET_ERROR("Out of memory.");
-            goto fail;
+            free(job->output.data);
+            job->state = FAIL;
+            failed = job;
         }
-
-        width = w;
-        size = width * sizeof(Pixel);
-        for (height = 0; height < h; height++)
+        else if (!node::Buffer::New(isolate, (char *)data, length).ToLocal(&buffer))
         {
-            if ((line = (Pixel *)malloc(size)) == NULL)
-            {
-                SET_ERROR("Out of memory.");
-                goto free;
-            }
-            memset(line, 0x00, size);
-            data[height] = line;
+            job->state = FAIL;
+            job->error = "Out of memory.";
+            failed = job;
+        }
+        else
+        {
+            buffers->Set(i, buffer);
         }
     }
-    size = Size();
-    AdjustAmountOfExternalAllocatedMemory(size);
-    Image::usedMemory += size;
-    return SUCCESS;
 
-free:
-    while (height--)
-        free(data[height]);
-    free(data);
+    if (failed != NULL)
+    {
+        argv[0] = Exception::Error(String::NewFromUtf8(isolate, failed->error ? failed->error : "Encode fail."));
+        argv[1] = v8::Undefined(isolate);
+    }
+    else
+    {
+        argv[0] = v8::Null(isolate);
+        argv[1] = buffers;
+    }
+
+    Local<Function> callback = Local<Function>::New(isolate, batch->callback);
+    context = batch->context;
+    batch->callback.Reset();
+    batch->resource.Reset();
+    batch->pixels.Free();
+    free(batch->jobs);
+    delete batch;
 
-fail:
-    width = height = 0;
-    type = EMPTY;
-    data = NULL;
-    return FAIL;
+    node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), callback, 2, argv, context);
+    node::EmitAsyncDestroy(isolate, context);
 } // }}}
 
-void PixelArray::Free()
+typedef struct EncodeStreamChunk {
+    uint8_t *data;
+    size_t length;
+    struct EncodeStreamChunk *next;
+} EncodeStreamChunk;
+
+// encodeStream, the encoder runs on the thread pool and hands its chunks over to the loop thread
+typedef struct {
+    uv_work_t request;
+    uv_async_t async;
+    uv_mutex_t mutex;
+    uv_cond_t cond;
+    PixelArray pixels; // snapshot
+    ImageCodec *codec;
+    ImageConfig config; // own copy, data is NULL if none
+    ImageData output;
+    ImageState state;
+    const char *error; // state and error are under mutex while the encoder runs
+    Persistent<Function> callback;
+    Persistent<Object> resource; // async_hooks resource of the stream
+    node::async_context context;
+
+    // Shared with the encoder, under mutex
+    EncodeStreamChunk *head, *tail;
+    size_t queued;
+    bool done;
+    bool canceled;
+
+    // Loop thread only
+    bool paused; // the last push() returned false
+    bool draining;
+    bool ended;
+} EncodeStreamJob;
+
+static void EncodeStreamDrain(EncodeStreamJob *job);
+
+static ImageState EncodeStreamFlush(void *context, const uint8_t *data, size_t length)
 { // {{{
-    size_t h, size;
+    EncodeStreamJob *job;
+    EncodeStreamChunk *chunk;
+    bool canceled;
+
+    job = (EncodeStreamJob *)context;
+    if ((chunk = (EncodeStreamChunk *)malloc(sizeof(EncodeStreamChunk))) == NULL)
+        return SET_ERROR("Out of memory.");
+    if ((chunk->data = (uint8_t *)malloc(length)) == NULL)
+    {
+        free(chunk);
+        return SET_ERROR("Out of memory.");
+    }
+    memcpy(chunk->data, data, length);
+    chunk->length = length;
+    chunk->next = NULL;
 
-    if (data != NULL)
+    uv_mutex_lock(&job->mutex);
+    if (job->tail != NULL)
+        job->tail->next = chunk;
+    else
+        job->head = chunk;
+    job->tail = chunk;
+    job->queued++;
+    uv_async_send(&job->async);
+
+    // Backpressure, wait until the reader takes some chunks
+    while (job->queued >= STREAM_QUEUE_SIZE && !job->canceled)
+        uv_cond_wait(&job->cond, &job->mutex);
+    canceled = job->canceled;
+    uv_mutex_unlock(&job->mutex);
+
+    return canceled ? SET_ERROR("Encode canceled.") : SUCCESS;
+} // }}}
+
+static void EncodeStreamClose(uv_handle_t *handle)
+{ // {{{
+    EncodeStreamJob *job;
+    EncodeStreamChunk *chunk;
+
+    job = (EncodeStreamJob *)handle->data;
+    node::EmitAsyncDestroy(Isolate::GetCurrent(), job->context);
+    job->resource.Reset();
+    while ((chunk = job->head) != NULL)
     {
-        h = height;
-        while (h--)
-        {
-            if (data[h] != NULL)
-                free(data[h]);
-        }
-        free(data);
-        size = Size();
-        AdjustAmountOfExternalAllocatedMemory(-size);
-        Image::usedMemory -= size;
+        job->head = chunk->next;
+        free(chunk->data);
+        free(chunk);
     }
+    uv_cond_destroy(&job->cond);
+    uv_mutex_destroy(&job->mutex);
+    free(job->config.data);
+    job->pixels.Free();
+    delete job;
+} // }}}
 
-    width = height = 0;
-    type = EMPTY;
-    ;
-    data = NULL;
+static void EncodeStreamAsync(uv_async_t *async)
+{ // {{{
+    EncodeStreamDrain((EncodeStreamJob *)async->data);
 } // }}}
 
-ImageState PixelArray::CopyFrom(PixelArray *src, size_t x, size_t y, size_t w, size_t h)
+// Hand the queued chunks to JS until push() asks to stop, then report the end once the encoder is done
+static void EncodeStreamDrain(EncodeStreamJob *job)
 { // {{{
-    size_t sw, sh, size;
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
 
-    sw = src->width;
-    sh = src->height;
+    EncodeStreamChunk *chunk;
+    Local<Object> buffer;
+    Local<Value> argv[2], ret;
+    Local<Function> callback;
+    bool done;
 
-    if (src->data && x < sw && y < sh)
+    if (job->draining)
+        return;
+    job->draining = true;
+
+    while (!job->paused && !job->ended)
     {
-        if (x + w > sw)
-            w = sw - x;
-        if (y + h > sh)
-            h = sh - y;
+        uv_mutex_lock(&job->mutex);
+        chunk = job->head;
+        if (chunk != NULL)
+        {
+            job->head = chunk->next;
+            if (job->head == NULL)
+                job->tail = NULL;
+            job->queued--;
+            uv_cond_signal(&job->cond);
+        }
+        done = job->done;
+        uv_mutex_unlock(&job->mutex);
 
-        Free();
-        size = w * sizeof(Pixel);
-        if (Malloc(w, h) != SUCCESS)
-            return FAIL;
+        callback = Local<Function>::New(isolate, job->callback);
+        if (chunk == NULL)
+        {
+            if (!done)
+                break;
 
-        while (h--)
+            job->ended = true;
+            if (job->state == SUCCESS)
+                argv[0] = v8::Null(isolate);
+            else
+                argv[0] = Exception::Error(String::NewFromUtf8(isolate, job->error ? job->error : "Encode fail."));
+            argv[1] = v8::Null(isolate);
+            job->callback.Reset();
+            uv_close((uv_handle_t *)&job->async, EncodeStreamClose);
+            node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), callback, 2, argv, job->context);
+            return;
+        }
+
+        // The Buffer takes over the chunk memory
+        if (!node::Buffer::New(isolate, (char *)chunk->data, chunk->length).ToLocal(&buffer))
         {
-            memcpy(data[h], &(src->data[y + h][x]), size);
+            free(chunk);
+            uv_mutex_lock(&job->mutex);
+            job->state = FAIL;
+            job->error = "Out of memory.";
+            job->canceled = true;
+            uv_cond_signal(&job->cond);
+            uv_mutex_unlock(&job->mutex);
+            continue;
         }
-        type = src->type;
-    }
+        free(chunk);
 
-    return SUCCESS;
+        argv[0] = v8::Null(isolate);
+        argv[1] = buffer;
+        if (node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), callback, 2, argv, job->context).ToLocal(&ret)
+            && !ret->BooleanValue())
+            job->paused = true;
+    }
+    job->draining = false;
 } // }}}
 
-void PixelArray::Draw(PixelArray *src, size_t x, size_t y)
+// read() resumes a paused stream, read(false) cancels the encode
+static void EncodeStreamRead(const FunctionCallbackInfo<Value> &args)
 { // {{{
-    //TODO
-    size_t sw, sh, dw, dh, w, h, sx, sy, size;
-    PixelArrayType st;
-    Pixel *sp, *dp;
+    EncodeStreamJob *job;
 
-    sw = src->width;
-    sh = src->height;
-    dw = width;
-    dh = height;
-    st = src->type;
+    job = (EncodeStreamJob *)Local<External>::Cast(args.Data())->Value();
+    if (job->ended)
+        return;
 
-    /* for TEST out put first pixel;
+    if (args[0]->IsFalse())
+    {
+        uv_mutex_lock(&job->mutex);
+        job->canceled = true;
+        uv_cond_signal(&job->cond);
+        uv_mutex_unlock(&job->mutex);
+    }
+    job->paused = false;
+    EncodeStreamDrain(job);
+} // }}}
 
-       printf("0x%02X%02X%02X\n",
-       src->data[0][0].R,
-       src->data[0][0].G,
-       src->data[0][0].B
-       );
-    //*/
+void Image::EncodeStream(const FunctionCallbackInfo<Value> &args)
+{ //{{{
+    Isolate *isolate = args.GetIsolate();
 
-    if (x < dw && y < dh)
+    Image *img;
+    EncodeStreamJob *job;
+    ImageCodec *codec;
+    ImageType type;
+    Local<Object> resource;
+
+    if (!args[0]->IsNumber() || !args[2]->IsFunction())
     {
-        w = (x + sw < dw) ? sw : (dw - x);
-        h = (y + sh < dh) ? sh : (dh - y);
-        size = w * sizeof(Pixel);
+        THROW_INVALID_ARGUMENTS_ERROR("");
+        return;
+    }
 
-        if (type == EMPTY || st == SOLID)
-        { // src opaque or dest empty
+    img = node::ObjectWrap::Unwrap<Image>(args.This());
+    if (img->pixels->data == NULL)
+    {
+        THROW_ERROR("Image uninitialized.");
+        return;
+    }
+
+    type = (ImageType)args[0]->Uint32Value();
+    for (codec = codecs; codec != NULL && codec->type != type; codec = codec->next)
+        ;
+    if (codec == NULL)
+    {
+        THROW_ERROR("Unsupported type.");
+        return;
+    }
+    if (!codec->CanEncode())
+    {
+        THROW_ERROR("Can't encode to this format.");
+        return;
+    }
+
+    job = new EncodeStreamJob();
+    job->pixels.data = NULL;
+    job->codec = codec;
+    job->config.data = NULL;
+    job->config.length = 0;
+    if (node::Buffer::HasInstance(args[1]))
+    {
+        job->config.length = node::Buffer::Length(args[1]);
+        job->config.data = (char *)malloc(job->config.length > 0 ? job->config.length : 1);
+    }
+    if ((job->config.length > 0 && job->config.data == NULL) ||
+        job->pixels.CopyFrom(img->pixels, 0, 0, img->pixels->width, img->pixels->height) != SUCCESS)
+    {
+        free(job->config.data);
+        delete job;
+        THROW_ERROR("Out of memory.");
+        return;
+    }
+    if (job->config.data != NULL)
+        memcpy(job->config.data, node::Buffer::Data(args[1]), job->config.length);
+
+    job->output.data = NULL;
+    job->output.length = 0;
+    job->output.position = 0;
+    job->output.fixed = false;
+    job->output.flush = EncodeStreamFlush;
+    job->output.context = job;
+    job->head = job->tail = NULL;
+    job->queued = 0;
+    job->done = job->canceled = false;
+    job->paused = job->draining = job->ended = false;
+    job->state = SUCCESS;
+    job->error = NULL;
+
+    uv_mutex_init(&job->mutex);
+    uv_cond_init(&job->cond);
+    uv_async_init(uv_default_loop(), &job->async, EncodeStreamAsync);
+    job->async.data = job;
+    job->request.data = job;
+    job->callback.Reset(isolate, Local<Function>::Cast(args[2]));
+    resource = Object::New(isolate);
+    job->resource.Reset(isolate, resource);
+    job->context = node::EmitAsyncInit(isolate, resource, "images:encodeStream");
+
+    uv_queue_work(uv_default_loop(), &job->request, EncodeStreamWork, EncodeStreamAfter);
+
+    args.GetReturnValue().Set(FunctionTemplate::New(isolate, EncodeStreamRead, External::New(isolate, job))->GetFunction());
+} // }}}
+
+void Image::EncodeStreamWork(uv_work_t *request)
+{ // {{{
+    EncodeStreamJob *job;
+    ImageState state;
+
+    // Runs on a pool thread, error is thread local
+    job = (EncodeStreamJob *)request->data;
+    state = job->codec->Encode(&job->pixels, &job->output, job->config.data != NULL ? &job->config : NULL);
+    if (state == SUCCESS)
+        state = job->output.Flush();
+    free(job->output.data);
+    job->output.data = NULL;
+
+    // Keep a failure the loop thread already recorded
+    uv_mutex_lock(&job->mutex);
+    if (job->state == SUCCESS)
+    {
+        job->state = state;
+        job->error = error;
+    }
+    uv_mutex_unlock(&job->mutex);
+    error = NULL;
+} // }}}
+
+void Image::EncodeStreamAfter(uv_work_t *request, int status)
+{ // {{{
+    EncodeStreamJob *job;
+
+    job = (EncodeStreamJob *)request->data;
+    if (status != 0)
+    {
+        job->state = FAIL;
+        job->error = "Encode canceled.";
+    }
+
+    uv_mutex_lock(&job->mutex);
+    job->done = true;
+    uv_mutex_unlock(&job->mutex);
+    EncodeStreamDrain(job);
+} // }}}
+
+void Image::DecodeChunk(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+
+    Image *img;
+
+    uint8_t *buffer;
+    unsigned start, end, length;
+    size_t size;
+
+    ImageCodec *codec;
+    ImageStream *stream;
+    ImageData input_data, *input, probe_data, *probe;
+    Local<Object> obj;
+
+    if (!node::Buffer::HasInstance(args[0]))
+    {
+        THROW_TYPE_ERROR(": first argument must be a buffer.");
+        return;
+    }
+
+    img = node::ObjectWrap::Unwrap<Image>(args.This());
+
+    buffer = (uint8_t *)node::Buffer::Data(args[0]);
+    length = (unsigned)node::Buffer::Length(args[0]);
+
+    start = 0;
+    if (args[1]->IsNumber())
+    {
+        start = args[1]->Uint32Value();
+    }
+
+    end = length;
+    if (args[2]->IsNumber())
+    {
+        end = args[2]->Uint32Value();
+        if (end < start || end > length)
+        {
+            THROW_TYPE_ERROR("");
+            return;
+        }
+    }
+
+    if (img->stream == NULL)
+    {
+        if ((stream = (ImageStream *)malloc(sizeof(ImageStream))) == NULL)
+        {
+            THROW_ERROR("Out of memory.");
+            return;
+        }
+        img->pixels->Free();
+        stream->output = img->pixels;
+        stream->rows = 0;
+        stream->done = false;
+        stream->context = NULL;
+        stream->options = NULL;
+        if (args[3]->IsObject())
+        {
+            // Only the size limits apply to a stream, it isn't cropped or scaled
+            obj = args[3]->ToObject();
+            memset(&img->streamOptions, 0x00, sizeof(ImageDecodeOptions));
+            img->streamOptions.max_pixels = getSizeOption(obj, "maxPixels");
+            img->streamOptions.max_bytes = getSizeOption(obj, "maxBytes");
+            stream->options = &img->streamOptions;
+        }
+        img->stream = stream;
+        img->streamCodec = NULL;
+        img->streamProbeLength = 0;
+    }
+    stream = img->stream;
+
+    input = &input_data;
+    input->data = &buffer[start];
+    input->length = end - start;
+    input->position = 0;
+    input->fixed = false;
+    input->flush = NULL;
+    input->context = NULL;
+
+    if (img->streamCodec == NULL)
+    {
+        // Collect enough leading bytes to tell the format
+        size = STREAM_PROBE_SIZE - img->streamProbeLength;
+        if (size > input->length)
+            size = input->length;
+        memcpy(&img->streamProbe[img->streamProbeLength], input->data, size);
+        img->streamProbeLength += size;
+        input->data += size;
+        input->length -= size;
+
+        probe = &probe_data;
+        probe->data = img->streamProbe;
+        probe->length = img->streamProbeLength;
+        probe->fixed = false;
+        probe->flush = NULL;
+        probe->context = NULL;
+
+        for (codec = codecs; codec != NULL && !isError(); codec = codec->next)
+        {
+            probe->position = 0;
+            if (codec->CanStream() && codec->StreamOpen(stream, probe) == SUCCESS)
+                break;
+        }
+
+        if (codec == NULL)
+        {
+            if (img->streamProbeLength < STREAM_PROBE_SIZE && !isError())
+            {
+                args.GetReturnValue().Set(Number::New(args.GetIsolate(), 0));
+                return;
+            }
+            img->closeStream();
+            img->pixels->Free();
+            isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Unknow format");
+            return;
+        }
+
+        img->streamCodec = codec;
+        probe->position = 0;
+        if (codec->StreamWrite(stream, probe) != SUCCESS)
+        {
+            img->closeStream();
+            img->pixels->Free();
+            isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Decode fail.");
+            return;
+        }
+    }
+
+    if (input->length > 0 && !stream->done && img->streamCodec->StreamWrite(stream, input) != SUCCESS)
+    {
+        img->closeStream();
+        img->pixels->Free();
+        isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Decode fail.");
+        return;
+    }
+
+    args.GetReturnValue().Set(Number::New(args.GetIsolate(), stream->rows));
+} // }}}
+
+void Image::DecodeEnd(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+
+    Image *img;
+    bool done;
+
+    img = node::ObjectWrap::Unwrap<Image>(args.This());
+
+    done = img->stream != NULL && img->stream->done;
+    img->closeStream();
+
+    if (!done)
+    {
+        img->pixels->Free();
+        THROW_ERROR("Unexpected end of data.");
+        return;
+    }
+
+    args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
+} // }}}
+
+void Image::GetFrames(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+
+    Isolate *isolate = args.GetIsolate();
+
+    ImageCodec *codec;
+    ImageData input_data, *input;
+    ImageDecodeOptions options_data, *options;
+    ImageAnimation animation;
+    ImageFrame *frame;
+    size_t i;
+
+    Local<Object> obj, result, item;
+    Local<Array> frames;
+
+    if (!node::Buffer::HasInstance(args[0]))
+    {
+        THROW_TYPE_ERROR(": first argument must be a buffer.");
+        return;
+    }
+
+    input = &input_data;
+    input->data = (uint8_t *)node::Buffer::Data(args[0]);
+    input->length = node::Buffer::Length(args[0]);
+    input->fixed = false;
+    input->flush = NULL;
+    input->context = NULL;
+
+    options = NULL;
+    if (args[1]->IsObject())
+    {
+        obj = args[1]->ToObject();
+        options = &options_data;
+        memset(options, 0x00, sizeof(ImageDecodeOptions));
+        options->max_pixels = getSizeOption(obj, "maxPixels");
+        options->max_bytes = getSizeOption(obj, "maxBytes");
+    }
+
+    codec = codecs;
+    while (codec != NULL && !isError())
+    {
+        input->position = 0;
+        if (codec->frames != NULL && codec->frames->info(&animation, input, options) == SUCCESS)
+        {
+            result = Object::New(isolate);
+            result->Set(String::NewFromUtf8(isolate, "type"), Number::New(isolate, codec->type));
+            result->Set(String::NewFromUtf8(isolate, "width"), Number::New(isolate, animation.width));
+            result->Set(String::NewFromUtf8(isolate, "height"), Number::New(isolate, animation.height));
+            result->Set(String::NewFromUtf8(isolate, "loop"), Number::New(isolate, animation.loop));
+
+            frames = Array::New(isolate, animation.count);
+            for (i = 0, frame = animation.frames; i < animation.count; i++, frame++)
+            {
+                item = Object::New(isolate);
+                item->Set(String::NewFromUtf8(isolate, "x"), Number::New(isolate, frame->x));
+                item->Set(String::NewFromUtf8(isolate, "y"), Number::New(isolate, frame->y));
+                item->Set(String::NewFromUtf8(isolate, "width"), Number::New(isolate, frame->width));
+                item->Set(String::NewFromUtf8(isolate, "height"), Number::New(isolate, frame->height));
+                item->Set(String::NewFromUtf8(isolate, "delay"), Number::New(isolate, frame->delay));
+                item->Set(String::NewFromUtf8(isolate, "disposal"), Number::New(isolate, frame->disposal));
+                frames->Set(i, item);
+            }
+            result->Set(String::NewFromUtf8(isolate, "frames"), frames);
+            free(animation.frames);
+
+            args.GetReturnValue().Set(result);
+            return;
+        }
+        codec = codec->next;
+    }
+    isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Unknow format");
+    return;
+} // }}}
+
+void Image::DrawFrame(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+
+    Image *img;
+
+    ImageCodec *codec;
+    ImageData input_data, *input;
+    ImageType type;
+    size_t index;
+
+    if (!node::Buffer::HasInstance(args[0]) || !args[1]->IsNumber() || !args[2]->IsNumber())
+    {
+        THROW_INVALID_ARGUMENTS_ERROR("");
+        return;
+    }
+
+    img = node::ObjectWrap::Unwrap<Image>(args.This());
+    type = (ImageType)args[1]->Uint32Value();
+    index = args[2]->Uint32Value();
+
+    input = &input_data;
+    input->data = (uint8_t *)node::Buffer::Data(args[0]);
+    input->length = node::Buffer::Length(args[0]);
+    input->position = 0;
+    input->fixed = false;
+    input->flush = NULL;
+    input->context = NULL;
+
+    codec = codecs;
+    while (codec != NULL && (codec->type != type || codec->frames == NULL))
+    {
+        codec = codec->next;
+    }
+
+    if (codec == NULL)
+    {
+        THROW_ERROR("Unknow format");
+        return;
+    }
+
+    if (codec->frames->draw(img->pixels, input, index) != SUCCESS)
+    {
+        isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Bad frame.");
+        return;
+    }
+
+    args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
+} // }}}
+
+void Image::ClearRect(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+
+    Image *img;
+
+    if (!args[0]->IsNumber() || !args[1]->IsNumber() || !args[2]->IsNumber() || !args[3]->IsNumber())
+    {
+        THROW_INVALID_ARGUMENTS_ERROR("");
+        return;
+    }
+
+    img = node::ObjectWrap::Unwrap<Image>(args.This());
+    img->pixels->Clear(args[0]->Uint32Value(), args[1]->Uint32Value(), args[2]->Uint32Value(), args[3]->Uint32Value());
+
+    args.GetReturnValue().Set(v8::Undefined(args.GetIsolate()));
+} // }}}
+
+void Image::closeStream()
+{ // {{{
+    if (stream != NULL)
+    {
+        if (streamCodec != NULL)
+            streamCodec->StreamClose(stream);
+        free(stream);
+        stream = NULL;
+    }
+    streamCodec = NULL;
+    streamProbeLength = 0;
+} // }}}
+
+void Image::regCodec(ImageDecoder decoder, ImageEncoder encoder, ImageType type, ImageStreamDecoder *stream, ImageFrameDecoder *frames)
+{ // {{{
+    ImageCodec *codec;
+    codec = (ImageCodec *)malloc(sizeof(ImageCodec));
+    codec->next = codecs;
+    codec->decoder = decoder;
+    codec->encoder = encoder;
+    codec->stream = stream;
+    codec->frames = frames;
+    codec->external = NULL;
+    codec->type = type;
+    codecs = codec;
+} // }}}
+
+typedef struct {
+    Isolate *isolate;
+    Local<Array> list;
+    uint32_t count;
+} ExternalRegistry;
+
+int Image::regExternal(void *registry, const images_codec *external)
+{ // {{{
+    ExternalRegistry *reg;
+    Local<Object> item;
+    bool streaming;
+
+    reg = (ExternalRegistry *)registry;
+    if (external == NULL || external->abi_version != IMAGES_CODEC_ABI_VERSION || external->name == NULL)
+        return 0;
+
+    // Stream hooks come as a set, decoding needs a way to recognize the input
+    streaming = external->stream_open != NULL;
+    if (streaming != (external->stream_write != NULL) || streaming != (external->stream_close != NULL))
+        return 0;
+    if (external->decode == NULL && external->encode == NULL && !streaming)
+        return 0;
+    if ((external->decode != NULL || streaming) && external->magic_length == 0 && external->probe == NULL)
+        return 0;
+
+    regCodec(NULL, NULL, (ImageType)externalType);
+    codecs->external = external;
+
+    item = Object::New(reg->isolate);
+    item->Set(String::NewFromUtf8(reg->isolate, "type"), Number::New(reg->isolate, externalType));
+    item->Set(String::NewFromUtf8(reg->isolate, "name"), String::NewFromUtf8(reg->isolate, external->name));
+    reg->list->Set(reg->count++, item);
+
+    return externalType++;
+} // }}}
+
+void Image::LoadCodec(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+    Isolate *isolate = args.GetIsolate();
+
+    uv_lib_t *lib;
+    images_codec_init_fn init;
+    ExternalRegistry registry;
+    int ret;
+
+    if (!args[0]->IsString())
+    {
+        THROW_INVALID_ARGUMENTS_ERROR(": path must be a string.");
+        return;
+    }
+
+    String::Utf8Value path(args[0]);
+
+    lib = (uv_lib_t *)malloc(sizeof(uv_lib_t));
+    if (lib == NULL)
+    {
+        THROW_ERROR("Out of memory.");
+        return;
+    }
+
+    if (uv_dlopen(*path, lib) != 0)
+    {
+        THROW(Exception::Error(String::NewFromUtf8(isolate, uv_dlerror(lib))));
+        uv_dlclose(lib);
+        free(lib);
+        return;
+    }
+
+    if (uv_dlsym(lib, IMAGES_CODEC_INIT, (void **)&init) != 0)
+    {
+        uv_dlclose(lib);
+        free(lib);
+        THROW_ERROR("Not an images codec, " IMAGES_CODEC_INIT " not found.");
+        return;
+    }
+
+    registry.isolate = isolate;
+    registry.list = Array::New(isolate);
+    registry.count = 0;
+    ret = init(regExternal, &registry);
+
+    // Registered codecs point into the library, keep it loaded
+    if (registry.count == 0)
+    {
+        uv_dlclose(lib);
+        free(lib);
+        THROW_ERROR("No codec registered.");
+        return;
+    }
+
+    if (ret != IMAGES_OK)
+    {
+        isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Codec init fail.");
+        return;
+    }
+
+    args.GetReturnValue().Set(registry.list);
+} // }}}
+
+#ifdef HAVE_JPEG
+void Image::JpegTransform(const FunctionCallbackInfo<Value> &args)
+{ // {{{
+    Isolate *isolate = args.GetIsolate();
+
+    ImageData input_data, *input, output_data, *output;
+    ::JpegTransform transform;
+    ImageDecodeOptions options;
+    Local<Object> obj;
+    Local<Object> buffer;
+    uint8_t *data;
+
+    if (!node::Buffer::HasInstance(args[0]) || !args[1]->IsObject())
+    {
+        THROW_INVALID_ARGUMENTS_ERROR("");
+        return;
+    }
+
+    input = &input_data;
+    input->data = (uint8_t *)node::Buffer::Data(args[0]);
+    input->length = node::Buffer::Length(args[0]);
+    input->position = 0;
+    input->fixed = false;
+    input->flush = NULL;
+    input->context = NULL;
+
+    obj = args[1]->ToObject();
+    transform.transpose = obj->Get(String::NewFromUtf8(isolate, "transpose"))->BooleanValue();
+    transform.mirror_x = obj->Get(String::NewFromUtf8(isolate, "mirrorX"))->BooleanValue();
+    transform.mirror_y = obj->Get(String::NewFromUtf8(isolate, "mirrorY"))->BooleanValue();
+    transform.crop_x = getSizeOption(obj, "cropX");
+    transform.crop_y = getSizeOption(obj, "cropY");
+    transform.crop_width = getSizeOption(obj, "cropWidth");
+    transform.crop_height = getSizeOption(obj, "cropHeight");
+
+    memset(&options, 0x00, sizeof(ImageDecodeOptions));
+    options.max_pixels = getSizeOption(obj, "maxPixels");
+    options.max_bytes = getSizeOption(obj, "maxBytes");
+
+    output = &output_data;
+    output->data = NULL;
+    output->length = 0;
+    output->position = 0;
+    output->fixed = false;
+    output->flush = NULL;
+    output->context = NULL;
+
+    if (jpegTransform(input, output, &transform, &options) != SUCCESS)
+    {
+        free(output->data);
+        isError() ? (THROW_GET_ERROR()) : THROW_ERROR("Transform fail.");
+        return;
+    }
+
+    data = output->position > 0 ? (uint8_t *)realloc(output->data, output->position) : NULL;
+    if (data == NULL)
+    {
+        free(output->data);
+        THROW_ERROR("Transform fail.");
+        return;
+    }
+    if (!node::Buffer::New(isolate, (char *)data, output->position).ToLocal(&buffer))
+    {
+        THROW_ERROR("Out of memory.");
+        return;
+    }
+    args.GetReturnValue().Set(buffer);
+} // }}}
+#endif
+
+// Host side of images_codec.h, decoders get an ExternalTarget to allocate into
+typedef struct {
+    PixelArray *output;
+    ImageDecodeOptions *options; // size limits of the caller, may be NULL
+} ExternalTarget;
+
+static uint8_t *externalAlloc(void *target, size_t width, size_t height)
+{ // {{{
+    ExternalTarget *external;
+    PixelArray *output;
+
+    external = (ExternalTarget *)target;
+    output = external->output;
+    output->Free();
+    if (Image::checkSize(width, height, external->options) != SUCCESS || output->Malloc(width, height) != SUCCESS)
+        return NULL;
+    return (uint8_t *)output->data[0];
+} // }}}
+
+static int externalWrite(void *target, const void *data, size_t length)
+{ // {{{
+    return ((ImageData *)target)->Write(data, length) == SUCCESS ? IMAGES_OK : IMAGES_FAIL;
+} // }}}
+
+static int externalError(const char *message)
+{ // {{{
+    Image::setError(message);
+    return IMAGES_FAIL;
+} // }}}
+
+static const images_host ExternalHost = {
+    externalAlloc,
+    externalWrite,
+    externalError,
+};
+
+static bool externalMatch(const images_codec *external, ImageData *input)
+{ // {{{
+    if (external->magic_length > 0)
+    {
+        if (input->length < external->magic_offset + external->magic_length)
+            return false;
+        if (memcmp(input->data + external->magic_offset, external->magic, external->magic_length) != 0)
+            return false;
+    }
+    return external->probe == NULL || external->probe(input->data, input->length) != 0;
+} // }}}
+
+bool ImageCodec::CanDecode()
+{ // {{{
+    return external != NULL ? external->decode != NULL : decoder != NULL;
+} // }}}
+
+bool ImageCodec::CanEncode()
+{ // {{{
+    return external != NULL ? external->encode != NULL : encoder != NULL;
+} // }}}
+
+bool ImageCodec::CanStream()
+{ // {{{
+    return external != NULL ? external->stream_open != NULL : stream != NULL;
+} // }}}
+
+ImageState ImageCodec::Decode(PixelArray *output, ImageData *input, ImageDecodeOptions *options)
+{ // {{{
+    ExternalTarget target;
+
+    if (external == NULL)
+        return decoder(output, input, options);
+
+    if (!externalMatch(external, input))
+        return FAIL;
+
+    // Options other than the size limits are left to Apply, external decoders see the whole image
+    target.output = output;
+    target.options = options;
+    if (external->decode(&ExternalHost, &target, input->data, input->length) != IMAGES_OK || output->data == NULL)
+    {
+        output->Free();
+        return FAIL;
+    }
+    output->DetectTransparent();
+    return SUCCESS;
+} // }}}
+
+ImageState ImageCodec::Encode(PixelArray *input, ImageData *output, ImageConfig *config)
+{ // {{{
+    if (external == NULL)
+        return encoder(input, output, config);
+
+    if (input->data == NULL)
+        return FAIL;
+
+    return external->encode(&ExternalHost, output, (const uint8_t *)input->data[0],
+            input->width, input->height, input->type != SOLID,
+            config != NULL ? (const uint8_t *)config->data : NULL, config != NULL ? config->length : 0)
+        == IMAGES_OK ? SUCCESS : FAIL;
+} // }}}
+
+ImageState ImageCodec::StreamOpen(ImageStream *s, ImageData *input)
+{ // {{{
+    if (external == NULL)
+        return stream->open(s, input);
+
+    if (!externalMatch(external, input))
+        return FAIL;
+
+    s->context = external->stream_open(input->data, input->length);
+    return s->context != NULL ? SUCCESS : FAIL;
+} // }}}
+
+ImageState ImageCodec::StreamWrite(ImageStream *s, ImageData *input)
+{ // {{{
+    ExternalTarget target;
+    int done;
+
+    if (external == NULL)
+        return stream->write(s, input);
+
+    target.output = s->output;
+    target.options = s->options;
+    done = 0;
+    if (external->stream_write(&ExternalHost, &target, s->context,
+                input->data + input->position, input->length - input->position, &s->rows, &done) != IMAGES_OK)
+        return FAIL;
+
+    input->position = input->length;
+    if (done)
+    {
+        if (s->output->data == NULL)
+            return FAIL;
+        s->output->DetectTransparent();
+        s->done = true;
+    }
+    return SUCCESS;
+} // }}}
+
+void ImageCodec::StreamClose(ImageStream *s)
+{ // {{{
+    if (external == NULL)
+        stream->close(s);
+    else if (s->context != NULL)
+        external->stream_close(s->context);
+} // }}}
+
+Image::Image()
+{ // {{{
+    size_t size;
+    pixels = (PixelArray *)malloc(sizeof(PixelArray));
+    pixels->width = pixels->height = 0;
+    pixels->type = EMPTY;
+    pixels->data = NULL;
+    stream = NULL;
+    streamCodec = NULL;
+    streamProbeLength = 0;
+    size = sizeof(PixelArray) + sizeof(Image);
+    AdjustAmountOfExternalAllocatedMemory(size);
+    usedMemory += size;
+    //survival++;
+} // }}}
+
+Image::~Image()
+{ // {{{
+    int32_t size;
+    size = sizeof(PixelArray) + sizeof(Image);
+    closeStream();
+    pixels->Free();
+    free(pixels);
+    AdjustAmountOfExternalAllocatedMemory(-size);
+    usedMemory -= size;
+    //survival--;
+    //printf("survival:%d\n", survival);
+} // }}}
+
+void Pixel::Merge(Pixel *pixel)
+{ // {{{
+    double a, af, ab;
+    ab = (double)A / 0xFF;
+    af = (double)pixel->A / 0xFF;
+    a = (1 - (1 - af) * (1 - ab));
+
+    R = (uint8_t)((pixel->R * af + R * ab * (1 - af)) / a);
+    G = (uint8_t)((pixel->G * af + G * ab * (1 - af)) / a);
+    B = (uint8_t)((pixel->B * af + B * ab * (1 - af)) / a);
+    A = (uint8_t)(a * 0xFF);
+} // }}}
+
+void ImageData::Estimate(size_t size)
+{ // {{{
+    uint8_t *buffer;
+
+    // Only a hint, writers grow the buffer on demand anyway
+    if (flush != NULL || fixed || position + size <= length)
+        return;
+
+    if ((buffer = (uint8_t *)realloc(data, position + size)) != NULL)
+    {
+        data = buffer;
+        length = position + size;
+    }
+} // }}}
+
+ImageState ImageData::Reserve(size_t size)
+{ // {{{
+    size_t len;
+    uint8_t *buffer;
+
+    if (flush != NULL)
+    {
+        // Streaming output only ever buffers one chunk
+        if (data != NULL)
+            return SUCCESS;
+        size = OUTPUT_CHUNK_SIZE;
+        position = 0;
+    }
+
+    if (data != NULL && position + size <= length)
+        return SUCCESS;
+
+    if (fixed)
+        return SET_ERROR("Output buffer too small.");
+
+    // Grow geometrically, so a big output costs O(log n) reallocs
+    len = position + size;
+    if (len < length * 2)
+        len = length * 2;
+    if (len < OUTPUT_INIT_SIZE)
+        len = OUTPUT_INIT_SIZE;
+
+    if ((buffer = (uint8_t *)realloc(data, len)) == NULL)
+        return SET_ERROR("Out of memory.");
+
+    data = buffer;
+    length = len;
+    return SUCCESS;
+} // }}}
+
+ImageState ImageData::Expand()
+{ // {{{
+    if (flush != NULL && data != NULL)
+        return Flush();
+    return Reserve(1);
+} // }}}
+
+ImageState ImageData::Write(const void *buffer, size_t size)
+{ // {{{
+    const uint8_t *src;
+    size_t len;
+
+    if (flush == NULL)
+    {
+        if (Reserve(size) != SUCCESS)
+            return FAIL;
+        memcpy(data + position, buffer, size);
+        position += size;
+        return SUCCESS;
+    }
+
+    src = (const uint8_t *)buffer;
+    while (size > 0)
+    {
+        if ((data == NULL || position == length) && Expand() != SUCCESS)
+            return FAIL;
+        len = length - position;
+        if (len > size)
+            len = size;
+        memcpy(data + position, src, len);
+        position += len;
+        src += len;
+        size -= len;
+    }
+    return SUCCESS;
+} // }}}
+
+ImageState ImageData::Flush()
+{ // {{{
+    if (flush == NULL || position == 0)
+        return SUCCESS;
+    if (flush(context, data, position) != SUCCESS)
+        return FAIL;
+    position = 0;
+    return SUCCESS;
+} // }}}
+
+bool ImageDecodeOptions::Crop(size_t w, size_t h, size_t *x, size_t *y, size_t *cw, size_t *ch)
+{ // {{{
+    *x = *y = 0;
+    *cw = w;
+    *ch = h;
+
+    if (crop_width == 0 || crop_height == 0 || crop_x >= w || crop_y >= h)
+        return false;
+
+    *x = crop_x;
+    *y = crop_y;
+    *cw = crop_width < w - crop_x ? crop_width : w - crop_x;
+    *ch = crop_height < h - crop_y ? crop_height : h - crop_y;
+    return *cw != w || *ch != h;
+} // }}}
+
+bool ImageDecodeOptions::Scale(size_t w, size_t h, size_t *sw, size_t *sh)
+{ // {{{
+    *sw = width;
+    *sh = height;
+
+    if (width == 0 && height == 0)
+    {
+        *sw = w;
+        *sh = h;
+        return false;
+    }
+
+    if (*sw == 0)
+        *sw = w * height / h > 0 ? w * height / h : 1;
+    if (*sh == 0)
+        *sh = h * width / w > 0 ? h * width / w : 1;
+    return *sw != w || *sh != h;
+} // }}}
+
+ImageState ImageDecodeOptions::Apply(PixelArray *pixels)
+{ // {{{
+    PixelArray part;
+    size_t x, y, w, h;
+
+    if (handled || pixels->data == NULL)
+        return SUCCESS;
+
+    if (!cropped && Crop(pixels->width, pixels->height, &x, &y, &w, &h))
+    {
+        part.data = NULL;
+        part.width = part.height = 0;
+        part.type = EMPTY;
+        if (part.CopyFrom(pixels, x, y, w, h) != SUCCESS)
+            return FAIL;
+        pixels->Free();
+        *pixels = part;
+    }
+
+    if (Scale(pixels->width, pixels->height, &w, &h) && pixels->Resize(w, h, NULL) != SUCCESS)
+        return FAIL;
+
+    handled = true;
+    return SUCCESS;
+} // }}}
+
+ImageState PixelArray::Malloc(size_t w, size_t h)
+{ // {{{
+    int32_t size;
+    size_t y, stride;
+    Pixel *line;
+
+    if (w > 0 && h > 0)
+    {
+        if (w > Image::maxWidth || h > Image::maxHeight)
+        {
+            SET_ERROR("Beyond the pixel size limit.");
+            goto fail;
+        }
+
+        // Row pointers and pixels share one block, rows are contiguous
+        stride = w * sizeof(Pixel);
+        if ((data = (Pixel **)calloc(1, h * sizeof(Pixel *) + h * stride)) == NULL)
+        {
+            SET_ERROR("Out of memory.");
+            goto fail;
+        }
+
+        width = w;
+        height = h;
+        line = (Pixel *)&data[h];
+        for (y = 0; y < h; y++, line += w)
+        {
+            data[y] = line;
+        }
+    }
+    size = Size();
+    AdjustAmountOfExternalAllocatedMemory(size);
+    Image::usedMemory += size;
+    return SUCCESS;
+
+fail:
+    width = height = 0;
+    type = EMPTY;
+    data = NULL;
+    return FAIL;
+} // }}}
+
+void PixelArray::Free()
+{ // {{{
+    size_t size;
+
+    if (data != NULL)
+    {
+        free(data);
+        size = Size();
+        AdjustAmountOfExternalAllocatedMemory(-size);
+        Image::usedMemory -= size;
+    }
+
+    width = height = 0;
+    type = EMPTY;
+    ;
+    data = NULL;
+} // }}}
+
+ImageState PixelArray::CopyFrom(PixelArray *src, size_t x, size_t y, size_t w, size_t h)
+{ // {{{
+    size_t sw, sh, size;
+
+    sw = src->width;
+    sh = src->height;
+
+    if (src->data && x < sw && y < sh)
+    {
+        if (x + w > sw)
+            w = sw - x;
+        if (y + h > sh)
+            h = sh - y;
+
+        Free();
+        size = w * sizeof(Pixel);
+        if (Malloc(w, h) != SUCCESS)
+            return FAIL;
+
+        while (h--)
+        {
+            memcpy(data[h], &(src->data[y + h][x]), size);
+        }
+        type = src->type;
+    }
+
+    return SUCCESS;
+} // }}}
+
+void PixelArray::Draw(PixelArray *src, size_t x, size_t y)
+{ // {{{
+    //TODO
+    size_t sw, sh, dw, dh, w, h, sx, sy, size;
+    PixelArrayType st;
+    Pixel *sp, *dp;
+
+    sw = src->width;
+    sh = src->height;
+    dw = width;
+    dh = height;
+    st = src->type;
+
+    /* for TEST out put first pixel;
+
+       printf("0x%02X%02X%02X\n",
+       src->data[0][0].R,
+       src->data[0][0].G,
+       src->data[0][0].B
+       );
+    //*/
+
+    if (x < dw && y < dh)
+    {
+        w = (x + sw < dw) ? sw : (dw - x);
+        h = (y + sh < dh) ? sh : (dh - y);
+        size = w * sizeof(Pixel);
+
+        if (type == EMPTY || st == SOLID)
+        { // src opaque or dest empty
             for (sy = 0; sy < h; sy++)
             {
                 sp = src->data[sy];
@@ -802,6 +2289,27 @@ void PixelArray::Fill(Pixel *color)
     }
 } // }}}
 
+void PixelArray::Clear(size_t x, size_t y, size_t w, size_t h)
+{ // {{{
+    size_t i, size;
+
+    if (data == NULL || type == EMPTY || x >= width || y >= height)
+        return;
+
+    if (w > width - x)
+        w = width - x;
+    if (h > height - y)
+        h = height - y;
+
+    size = w * sizeof(Pixel);
+    for (i = y; i < y + h; i++)
+    {
+        memset(&(data[i][x]), 0x00, size);
+    }
+
+    type = (w == width && h == height) ? EMPTY : ALPHA;
+} // }}}
+
 ImageState PixelArray::SetWidth(size_t w)
 { // {{{
     size_t size, *index, *p, x, y;
@@ -901,7 +2409,7 @@ ImageState PixelArray::SetHeight(size_t h)
     return SUCCESS;
 } // }}}
 
-ImageState PixelArray::Resize(size_t w, size_t h, const char *filter)
+ImageState PixelArray::Resize(size_t w, size_t h, const char *filter, bool fast)
 {
     PixelArray newArray, *pixels;
 
@@ -939,7 +2447,7 @@ ImageState PixelArray::Resize(size_t w, size_t h, const char *filter)
         }
         pixels->type = type;
 
-        resize(this, pixels, filter);
+        resize(this, pixels, filter, fast);
 
         Free();
         *this = *pixels;
@@ -979,39 +2487,36 @@ ImageState PixelArray::Rotate(size_t deg)
 
 void PixelArray::DetectTransparent()
 { // {{{
-    size_t x, y;
+    size_t i, j, n, count;
     Pixel *pixel;
-    bool empty, opaque, alpha;
-    type = EMPTY;
+    uint8_t all, any;
 
-    empty = opaque = alpha = false;
+    type = EMPTY;
+    if (data == NULL)
+        return;
 
-    for (y = 0; y < height; y++)
+    // Rows are contiguous, fold the alpha channel in blocks so the inner loop vectorizes
+    pixel = data[0];
+    count = width * height;
+    all = 0xFF;
+    any = 0x00;
+    for (i = 0; i < count; i += n)
     {
-        pixel = data[y];
-        for (x = 0; x < width; x++, pixel++)
+        n = count - i < 4096 ? count - i : 4096;
+        for (j = 0; j < n; j++)
         {
-            switch (pixel->A)
-            {
-            case 0x00:
-                empty = true;
-                break;
-            case 0xFF:
-                opaque = true;
-                break;
-            default:
-                alpha = true;
-                break;
-            }
+            all &= pixel[i + j].A;
+            any |= pixel[i + j].A;
+        }
 
-            if (alpha || (empty && opaque))
-            {
-                type = ALPHA;
-                return;
-            }
+        // Some pixel isn't opaque and some isn't empty
+        if (all != 0xFF && any != 0x00)
+        {
+            type = ALPHA;
+            return;
         }
     }
-    type = opaque ? SOLID : EMPTY;
+    type = all == 0xFF ? SOLID : EMPTY;
 } // }}}
 
 extern "C"
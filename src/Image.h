@@ -33,6 +33,10 @@
 #include <node_object_wrap.h>
 #include <node_api.h>
 
+#include "images_codec.h"
+
+typedef struct uv_work_s uv_work_t;
+
 typedef enum {
     TYPE_PNG = 1,
     TYPE_JPEG,
@@ -40,6 +44,10 @@ typedef enum {
     TYPE_BMP,
     TYPE_RAW,
     TYPE_WEBP,
+    TYPE_QOI,
+
+    // First type handed out to codecs loaded at runtime
+    TYPE_EXTERNAL = 64,
 } ImageType;
 
 typedef enum {
@@ -63,7 +71,7 @@ typedef enum {
 } PixelArrayType;
 
 typedef struct PixelArray {
-    Pixel **data;
+    Pixel **data; // row pointers into a single block, data[0] is the whole image
     size_t width;
     size_t height;
     PixelArrayType type;
@@ -84,23 +92,47 @@ typedef struct PixelArray {
 
     void Fill(Pixel *color);
 
+    void Clear(size_t x, size_t y, size_t w, size_t h);
+
     // Transform
     ImageState SetWidth(size_t w);
 
     ImageState SetHeight(size_t h);
 
-    ImageState Resize(size_t w, size_t h, const char *filter);
+    // fast resamples in fixed point, otherwise in float
+    ImageState Resize(size_t w, size_t h, const char *filter, bool fast = true);
     
     ImageState Rotate(size_t deg);
 
     void DetectTransparent();
 } PixelArray;
 
-typedef struct {
+// Receive a chunk of encoded output, return FAIL to abort the encoding
+typedef ImageState (*ImageDataFlush)(void *context, const uint8_t *data, size_t length);
+
+typedef struct ImageData {
     uint8_t *data;
     unsigned long length;
     unsigned long position;
     //ImageType type;
+
+    // Output buffer is owned by the caller and can't grow
+    bool fixed;
+
+    // Streaming output, data is handed out in chunks when flush is set
+    ImageDataFlush flush;
+    void *context;
+
+    // Output
+    void Estimate(size_t size);
+
+    ImageState Reserve(size_t size);
+
+    ImageState Expand();
+
+    ImageState Write(const void *buffer, size_t size);
+
+    ImageState Flush();
 } ImageData;
 
 typedef struct {
@@ -110,32 +142,167 @@ typedef struct {
 
 typedef ImageState (*ImageEncoder)(PixelArray *input, ImageData *output, ImageConfig *config);
 
-typedef ImageState (*ImageDecoder)(PixelArray *output, ImageData *input);
+// Shrink-on-load, decoders that can crop or scale while decoding set handled,
+// otherwise the decoded image is cropped and resized afterwards
+typedef struct ImageDecodeOptions {
+    // Crop rectangle in source pixels, ignored if crop_width or crop_height is 0
+    size_t crop_x;
+    size_t crop_y;
+    size_t crop_width;
+    size_t crop_height;
+
+    // Size after cropping, 0 keeps the aspect ratio, both 0 keep the size
+    size_t width;
+    size_t height;
+
+    // Turn the image upright from its EXIF orientation, before cropping
+    bool auto_orient;
+
+    // Accept an embedded preview (EXIF thumbnail) at least as large as the target size
+    bool thumbnail;
+
+    // Replace Image::maxPixels and Image::maxBytes for this call, 0 keeps them
+    size_t max_pixels;
+    size_t max_bytes;
+
+    // Set by decoders that only decoded the crop rectangle
+    bool cropped;
+
+    bool handled;
+
+    bool Crop(size_t w, size_t h, size_t *x, size_t *y, size_t *cw, size_t *ch);
+
+    bool Scale(size_t w, size_t h, size_t *sw, size_t *sh);
+
+    ImageState Apply(PixelArray *pixels);
+} ImageDecodeOptions;
+
+typedef ImageState (*ImageDecoder)(PixelArray *output, ImageData *input, ImageDecodeOptions *options);
+
+// Incremental decoding, input arrives in chunks
+typedef struct ImageStream {
+    PixelArray *output;
+    size_t rows;   // rows of output completely decoded so far
+    bool done;     // whole image decoded
+    void *context; // decoder state
+    ImageDecodeOptions *options; // size limits of the caller, may be NULL
+} ImageStream;
+
+// Check the leading bytes and set up the decoder, FAIL if it's not this format
+typedef ImageState (*ImageStreamOpen)(ImageStream *stream, ImageData *input);
+
+// Consume the next chunk of input
+typedef ImageState (*ImageStreamWrite)(ImageStream *stream, ImageData *input);
+
+typedef void (*ImageStreamClose)(ImageStream *stream);
+
+typedef struct {
+    ImageStreamOpen open;
+    ImageStreamWrite write;
+    ImageStreamClose close;
+} ImageStreamDecoder;
+
+// Animation
+typedef enum {
+    DISPOSE_NONE = 0,
+    DISPOSE_BACKGROUND, // clear the frame rectangle before the next frame
+    DISPOSE_PREVIOUS,   // restore the canvas to what it was before the frame
+} ImageDisposal;
+
+typedef struct {
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+    uint32_t delay; // milliseconds
+    ImageDisposal disposal;
+} ImageFrame;
+
+typedef struct {
+    size_t width;
+    size_t height;
+    int loop; // 0 loops forever, -1 if not given
+    size_t count;
+    ImageFrame *frames; // malloc'd by the codec, freed by the caller
+} ImageAnimation;
+
+// Read the frame layout without decoding any pixels, FAIL if it's not this format
+typedef ImageState (*ImageFrameInfo)(ImageAnimation *output, ImageData *input, ImageDecodeOptions *options);
+
+// Composite one frame onto a canvas of the screen size, disposal is left to the caller
+typedef ImageState (*ImageFrameDraw)(PixelArray *output, ImageData *input, size_t index);
+
+typedef struct {
+    ImageFrameInfo info;
+    ImageFrameDraw draw;
+} ImageFrameDecoder;
 
 typedef struct ImageCodec {
     ImageType type;
     ImageEncoder encoder;
     ImageDecoder decoder;
+    ImageStreamDecoder *stream;
+    ImageFrameDecoder *frames;
+    const images_codec *external; // loaded from a shared object, see images_codec.h
     struct ImageCodec *next;
+
+    // Dispatch to the built-in functions or the external codec
+    bool CanDecode();
+
+    bool CanEncode();
+
+    bool CanStream();
+
+    ImageState Decode(PixelArray *output, ImageData *input, ImageDecodeOptions *options);
+
+    ImageState Encode(PixelArray *input, ImageData *output, ImageConfig *config);
+
+    ImageState StreamOpen(ImageStream *stream, ImageData *input);
+
+    ImageState StreamWrite(ImageStream *stream, ImageData *input);
+
+    void StreamClose(ImageStream *stream);
 } ImageCodec;
 
 #define ENCODER(type) encode ## type
 #define ENCODER_FN(type) ImageState ENCODER(type)(PixelArray *input, ImageData *output, ImageConfig *config)
 #define DECODER(type) decode ## type
-#define DECODER_FN(type) ImageState DECODER(type)(PixelArray *output, ImageData *input)
+#define DECODER_FN(type) ImageState DECODER(type)(PixelArray *output, ImageData *input, ImageDecodeOptions *options)
 #define IMAGE_CODEC(type) DECODER_FN(type); ENCODER_FN(type)
+#define STREAM_DECODER(type) streamDecoder ## type
+#define STREAM_PROBE_SIZE 32
+#define STREAM_DECODER_DECL(type) extern ImageStreamDecoder STREAM_DECODER(type)
+#define FRAME_DECODER(type) frameDecoder ## type
+#define FRAME_DECODER_DECL(type) extern ImageFrameDecoder FRAME_DECODER(type)
 
 
 #ifdef HAVE_PNG
 IMAGE_CODEC(Png);
+STREAM_DECODER_DECL(Png);
 #endif
 
 #ifdef HAVE_JPEG
 IMAGE_CODEC(Jpeg);
+
+// Lossless transform of the coefficients: transpose, then mirror, then crop
+typedef struct {
+    bool transpose;
+    bool mirror_x;
+    bool mirror_y;
+
+    // Crop rectangle in output pixels, moved back to an iMCU boundary, ignored if crop_width or crop_height is 0
+    size_t crop_x;
+    size_t crop_y;
+    size_t crop_width;
+    size_t crop_height;
+} JpegTransform;
+
+ImageState jpegTransform(ImageData *input, ImageData *output, JpegTransform *transform, ImageDecodeOptions *options);
 #endif
 
 #ifdef HAVE_GIF
 IMAGE_CODEC(Gif);
+FRAME_DECODER_DECL(Gif);
 #endif
 
 #ifdef HAVE_BMP
@@ -146,8 +313,13 @@ IMAGE_CODEC(Bmp);
 IMAGE_CODEC(Raw);
 #endif
 
+#ifdef HAVE_QOI
+IMAGE_CODEC(Qoi);
+#endif
+
 #ifdef HAVE_WEBP
 IMAGE_CODEC(Webp);
+STREAM_DECODER_DECL(Webp);
 #endif
 
 class Image : public node::ObjectWrap {
@@ -167,6 +339,12 @@ class Image : public node::ObjectWrap {
         // Size Limit
         static size_t maxWidth, maxHeight;
 
+        // Budget of the decoded image, 0 for none
+        static size_t maxPixels, maxBytes;
+
+        // Checked by the decoders against the size in the header, before allocating anything
+        static ImageState checkSize(size_t width, size_t height, ImageDecodeOptions *options = NULL);
+
         static void GetMaxWidth(v8::Local<v8::String>, const v8::PropertyCallbackInfo<v8::Value> &args);
 
         static void SetMaxWidth(v8::Local<v8::String>, v8::Local<v8::Value>, const v8::PropertyCallbackInfo<void> &args);
@@ -175,6 +353,14 @@ class Image : public node::ObjectWrap {
 
         static void SetMaxHeight(v8::Local<v8::String>, v8::Local<v8::Value>, const v8::PropertyCallbackInfo<void> &args);
 
+        static void GetMaxPixels(v8::Local<v8::String>, const v8::PropertyCallbackInfo<v8::Value> &args);
+
+        static void SetMaxPixels(v8::Local<v8::String>, v8::Local<v8::Value>, const v8::PropertyCallbackInfo<void> &args);
+
+        static void GetMaxBytes(v8::Local<v8::String>, const v8::PropertyCallbackInfo<v8::Value> &args);
+
+        static void SetMaxBytes(v8::Local<v8::String>, v8::Local<v8::Value>, const v8::PropertyCallbackInfo<void> &args);
+
         // Memory
         static size_t usedMemory;
 
@@ -182,6 +368,15 @@ class Image : public node::ObjectWrap {
 
         static void GC(const v8::FunctionCallbackInfo<v8::Value> &args);
         //static void GC(napi_env env,const napi_callback_info &args );
+
+        // Out-of-tree codecs
+        static void LoadCodec(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+#ifdef HAVE_JPEG
+        // Lossless JPEG rotation, flip and crop
+        static void JpegTransform(const v8::FunctionCallbackInfo<v8::Value> &args);
+#endif
+
         // Image constructor
         static void New(const v8::FunctionCallbackInfo<v8::Value> &args);
 
@@ -206,22 +401,54 @@ class Image : public node::ObjectWrap {
 
         static void ToBuffer(const v8::FunctionCallbackInfo<v8::Value> &args);
 
+        // Several encodes of one snapshot on the thread pool
+        static void EncodeMany(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+        // Chunked encode on the thread pool, returns read() to resume after backpressure
+        static void EncodeStream(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+        static void DecodeChunk(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+        static void DecodeEnd(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+        static void GetFrames(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+        static void DrawFrame(const v8::FunctionCallbackInfo<v8::Value> &args);
+
+        static void ClearRect(const v8::FunctionCallbackInfo<v8::Value> &args);
+
         static void CopyFromImage(const v8::FunctionCallbackInfo<v8::Value> &args);
 
         static void DrawImage(const v8::FunctionCallbackInfo<v8::Value> &args);
 
     private:
-        static const char *error;
+        // Per thread, encodeMany runs codecs on the thread pool
+        static thread_local const char *error;
         static int errno;
 
         static ImageCodec *codecs;
 
-        static void regCodec(ImageDecoder decoder, ImageEncoder encoder, ImageType type);
+        static void regCodec(ImageDecoder decoder, ImageEncoder encoder, ImageType type, ImageStreamDecoder *stream = NULL, ImageFrameDecoder *frames = NULL);
+
+        static int externalType;
+
+        static int regExternal(void *registry, const images_codec *codec);
+
+        static void EncodeManyWork(uv_work_t *request);
+
+        static void EncodeManyAfter(uv_work_t *request, int status);
+
+        static void EncodeStreamWork(uv_work_t *request);
+
+        static void EncodeStreamAfter(uv_work_t *request, int status);
 
         static void regAllCodecs() {
             codecs = NULL;
+#ifdef HAVE_QOI
+            regCodec(DECODER(Qoi), ENCODER(Qoi), TYPE_QOI);
+#endif
 #ifdef HAVE_WEBP
-            regCodec(DECODER(Webp), ENCODER(Webp), TYPE_WEBP);
+            regCodec(DECODER(Webp), ENCODER(Webp), TYPE_WEBP, &STREAM_DECODER(Webp));
 #endif
 #ifdef HAVE_RAW
             regCodec(DECODER(Raw), ENCODER(Raw), TYPE_RAW);
@@ -230,18 +457,31 @@ class Image : public node::ObjectWrap {
             regCodec(DECODER(Bmp), ENCODER(Bmp), TYPE_BMP);
 #endif
 #ifdef HAVE_GIF
-            regCodec(DECODER(Gif), ENCODER(Gif), TYPE_GIF);
+            regCodec(DECODER(Gif), ENCODER(Gif), TYPE_GIF, NULL, &FRAME_DECODER(Gif));
 #endif
 #ifdef HAVE_JPEG
             regCodec(DECODER(Jpeg), ENCODER(Jpeg), TYPE_JPEG);
 #endif
 #ifdef HAVE_PNG
-            regCodec(DECODER(Png), ENCODER(Png), TYPE_PNG);
+            regCodec(DECODER(Png), ENCODER(Png), TYPE_PNG, &STREAM_DECODER(Png));
 #endif
         }
 
         PixelArray *pixels;
 
+        // Incremental decoding
+        ImageStream *stream;
+
+        ImageDecodeOptions streamOptions;
+
+        ImageCodec *streamCodec;
+
+        uint8_t streamProbe[STREAM_PROBE_SIZE];
+
+        size_t streamProbeLength;
+
+        void closeStream();
+
         Image();
 
         ~Image();
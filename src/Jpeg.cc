@@ -37,6 +37,7 @@
 
 #include <setjmp.h>
 #include <jpeglib.h>
+#include <jerror.h>
 
 typedef struct {
 	char J;
@@ -44,11 +45,15 @@ typedef struct {
 	char E;
 	char G;
 	uint8_t quality;
+	uint8_t max_bytes[4]; // little endian, 0 for no limit
 } jpeg_compress_config;
 
+#define JPEG_U32(p) ((uint32_t) (p)[0] | (uint32_t) (p)[1] << 8 | (uint32_t) (p)[2] << 16 | (uint32_t) (p)[3] << 24)
+
 jpeg_compress_config default_compress_config = {
 	'J','P','E','G',
 	100,
+	{0, 0, 0, 0},
 };
 
 jpeg_compress_config *get_compress_config(ImageConfig *config){
@@ -75,12 +80,201 @@ void jpeg_cb_error_exit(j_common_ptr cinfo){
 	longjmp(mptr->setjmp_buffer, 1);
 }
 
-DECODER_FN(Jpeg){ // {{{
+// EXIF, a TIFF structure inside APP1
+#define EXIF_ORIENTATION 0x0112
+#define EXIF_THUMBNAIL_OFFSET 0x0201
+#define EXIF_THUMBNAIL_LENGTH 0x0202
+#define EXIF_HEADER_SIZE 6
+#define JPEG_ORIENT_BLOCK 16
+
+typedef struct {
+	uint8_t *data; // TIFF header
+	size_t length;
+	bool little;
+} jpeg_exif;
+
+static uint16_t exif_u16(jpeg_exif *exif, size_t offset){
+	const uint8_t *p = exif->data + offset;
+	return exif->little ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static uint32_t exif_u32(jpeg_exif *exif, size_t offset){
+	return exif->little
+		? (uint32_t) exif_u16(exif, offset) | (uint32_t) exif_u16(exif, offset + 2) << 16
+		: (uint32_t) exif_u16(exif, offset) << 16 | (uint32_t) exif_u16(exif, offset + 2);
+}
+
+bool jpeg_exif_open(jpeg_exif *exif, jpeg_saved_marker_ptr marker){ // {{{
+	for(; marker != NULL; marker = marker->next){
+		if(marker->marker != JPEG_APP0 + 1 || marker->data_length < EXIF_HEADER_SIZE + 8
+		|| memcmp(marker->data, "Exif\0\0", EXIF_HEADER_SIZE) != 0)
+			continue;
+
+		exif->data = marker->data + EXIF_HEADER_SIZE;
+		exif->length = marker->data_length - EXIF_HEADER_SIZE;
+		if(exif->data[0] == 'I' && exif->data[1] == 'I'){
+			exif->little = true;
+		}else if(exif->data[0] == 'M' && exif->data[1] == 'M'){
+			exif->little = false;
+		}else{
+			continue;
+		}
+		if(exif_u16(exif, 2) == 0x2A) return true;
+	}
+	return false;
+} // }}}
+
+// Offset of the tag's 12 byte entry in the IFD at offset, 0 if not found
+size_t jpeg_exif_entry(jpeg_exif *exif, size_t ifd, uint16_t tag){ // {{{
+	size_t count, entry;
+
+	if(ifd == 0 || ifd > exif->length - 2) return 0;
+	count = exif_u16(exif, ifd);
+	for(entry = ifd + 2; count > 0 && entry + 12 <= exif->length; count--, entry += 12){
+		if(exif_u16(exif, entry) == tag) return entry;
+	}
+	return 0;
+} // }}}
+
+// Value of a SHORT or LONG tag
+bool jpeg_exif_tag(jpeg_exif *exif, size_t ifd, uint16_t tag, uint32_t *value){ // {{{
+	size_t entry;
+
+	if((entry = jpeg_exif_entry(exif, ifd, tag)) == 0) return false;
+	switch(exif_u16(exif, entry + 2)){
+		case 3: // SHORT
+			*value = exif_u16(exif, entry + 8);
+			return true;
+		case 4: // LONG
+			*value = exif_u32(exif, entry + 8);
+			return true;
+		default:
+			return false;
+	}
+} // }}}
+
+// 1 to 8, 1 is upright
+int jpeg_exif_orientation(j_decompress_ptr cinfo){ // {{{
+	jpeg_exif exif;
+	uint32_t value;
+
+	if(!jpeg_exif_open(&exif, cinfo->marker_list)) return 1;
+	if(!jpeg_exif_tag(&exif, exif_u32(&exif, 4), EXIF_ORIENTATION, &value) || value < 1 || value > 8) return 1;
+	return value;
+} // }}}
+
+void jpeg_mirror_row(Pixel *row, size_t width){ // {{{
+	Pixel *end, tmp;
+
+	for(end = row + width - 1; row < end; row++, end--){
+		tmp = *row;
+		*row = *end;
+		*end = tmp;
+	}
+} // }}}
+
+// Scatter a block of decoded lines into the columns of the transposed output (orientation 5 to 8),
+// every source column becomes a run of lines pixels in one output row
+void jpeg_transpose_block(PixelArray *output, Pixel *block, size_t stride, size_t lines, size_t y, size_t width, size_t height, int orientation){ // {{{
+	size_t x, k;
+	Pixel *src, *dst;
+
+	for(x = 0; x < width; x++){
+		dst = output->data[orientation == 5 || orientation == 6 ? x : width - 1 - x];
+		src = block + x;
+		if(orientation == 5 || orientation == 8){
+			dst += y;
+			for(k = 0; k < lines; k++, src += stride) dst[k] = *src;
+		}else{
+			dst += height - 1 - y;
+			for(k = 0; k < lines; k++, src += stride) *(dst - k) = *src;
+		}
+	}
+} // }}}
+
+// Map a rectangle of the upright image back to the stored one
+void jpeg_orient_rect(int orientation, size_t width, size_t height, size_t *x, size_t *y, size_t *w, size_t *h){ // {{{
+	size_t ux, uy, uw, uh;
+
+	ux = *x;
+	uy = *y;
+	uw = *w;
+	uh = *h;
+	if(orientation >= 5){
+		*w = uh;
+		*h = uw;
+	}
+	switch(orientation){
+		case 2: *x = width - ux - uw; break;
+		case 3: *x = width - ux - uw; *y = height - uy - uh; break;
+		case 4: *y = height - uy - uh; break;
+		case 5: *x = uy; *y = ux; break;
+		case 6: *x = uy; *y = height - ux - uw; break;
+		case 7: *x = width - uy - uh; *y = height - ux - uw; break;
+		case 8: *x = width - uy - uh; *y = ux; break;
+	}
+} // }}}
+
+// The EXIF preview, a complete JPEG referenced from IFD1
+bool jpeg_exif_thumbnail(j_decompress_ptr cinfo, uint8_t **data, size_t *length){ // {{{
+	jpeg_exif exif;
+	size_t ifd0, ifd1;
+	uint32_t offset, size;
+
+	if(!jpeg_exif_open(&exif, cinfo->marker_list)) return false;
+	ifd0 = exif_u32(&exif, 4);
+	if(ifd0 == 0 || ifd0 > exif.length - 2) return false;
+	ifd1 = ifd0 + 2 + exif_u16(&exif, ifd0) * 12;
+	if(ifd1 > exif.length - 4 || (ifd1 = exif_u32(&exif, ifd1)) == 0) return false;
+
+	if(!jpeg_exif_tag(&exif, ifd1, EXIF_THUMBNAIL_OFFSET, &offset) || !jpeg_exif_tag(&exif, ifd1, EXIF_THUMBNAIL_LENGTH, &size)
+	|| size < 4 || offset > exif.length || size > exif.length - offset)
+		return false;
+
+	*data = exif.data + offset;
+	*length = size;
+	return (*data)[0] == 0xFF && (*data)[1] == 0xD8;
+} // }}}
+
+// Size of a JPEG from its header
+bool jpeg_peek_size(uint8_t *data, size_t length, size_t *width, size_t *height){ // {{{
 	struct jpeg_decompress_struct cinfo;
 	struct my_jpeg_error_mgr jerr;
 
-	int width, height, line;
-	JSAMPROW row_pointer[1];
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit=jpeg_cb_error_exit;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *) data, length);
+	jpeg_read_header(&cinfo, TRUE);
+	*width = cinfo.image_width;
+	*height = cinfo.image_height;
+	jpeg_destroy_decompress(&cinfo);
+	return true;
+} // }}}
+
+// orientation is 0 to read it from the EXIF when asked, the preview is decoded with the main image's one
+ImageState jpeg_decode(PixelArray *output, uint8_t *data, size_t length, ImageDecodeOptions *options, int orientation){ // {{{
+	struct jpeg_decompress_struct cinfo;
+	struct my_jpeg_error_mgr jerr;
+
+	size_t width, height, x, y, w, h, line, lines, stride, skip, swap;
+	size_t crop_x, crop_y, crop_w, crop_h;
+	int i;
+	unsigned int denom;
+	bool cropped;
+	JSAMPROW row_pointer[JPEG_ORIENT_BLOCK];
+	JDIMENSION left, columns;
+	Pixel * volatile block = NULL;
+	Pixel *src;
+	uint8_t *thumbnail;
+	size_t thumbnail_length;
+	ImageState state;
 
 
 	cinfo.err = jpeg_std_error(&jerr.pub);
@@ -88,39 +282,202 @@ DECODER_FN(Jpeg){ // {{{
 
 	if (setjmp(jerr.setjmp_buffer)) {
 		jpeg_destroy_decompress(&cinfo);
+		free(block);
 		output->Free();
 		return FAIL;
 	}
 
 	jpeg_create_decompress(&cinfo);
-	jpeg_mem_src(&cinfo, (unsigned char *) input->data, input->length);	
+	jpeg_mem_src(&cinfo, (unsigned char *) data, length);	
+	if(options != NULL && orientation == 0 && (options->auto_orient || options->thumbnail))
+		jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
 	jpeg_read_header(&cinfo, TRUE);
 	cinfo.out_color_space = JCS_EXT_RGBA;
+
+	width = cinfo.image_width;
+	height = cinfo.image_height;
+	if(Image::checkSize(width, height, options) != SUCCESS){
+		jpeg_destroy_decompress(&cinfo);
+		return FAIL;
+	}
+	if(orientation == 0)
+		orientation = options != NULL && options->auto_orient ? jpeg_exif_orientation(&cinfo) : 1;
+	if(orientation >= 5){
+		w = height;
+		h = width;
+	}else{
+		w = width;
+		h = height;
+	}
+
+	// Without a crop, the embedded preview or a DCT scaled decode is enough for a smaller target
+	if(options != NULL && !options->Crop(w, h, &crop_x, &crop_y, &crop_w, &crop_h)){
+		options->Scale(w, h, &crop_w, &crop_h);
+
+		if(options->thumbnail && jpeg_exif_thumbnail(&cinfo, &thumbnail, &thumbnail_length)
+		&& jpeg_peek_size(thumbnail, thumbnail_length, &x, &y)){
+			if(orientation >= 5){
+				swap = x;
+				x = y;
+				y = swap;
+			}
+			// The preview lives in the saved marker, decode it before letting go of cinfo
+			if((options->width == 0 && options->height == 0) || (x >= crop_w && y >= crop_h)){
+				state = jpeg_decode(output, thumbnail, thumbnail_length, options, orientation);
+				jpeg_destroy_decompress(&cinfo);
+				return state;
+			}
+		}
+
+		for(denom = 8; denom > 1; denom /= 2){
+			if((w + denom - 1) / denom >= crop_w && (h + denom - 1) / denom >= crop_h) break;
+		}
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = denom;
+	}
+
 	jpeg_start_decompress(&cinfo);
 
 	width = cinfo.output_width;
 	height = cinfo.output_height;
 	//components = cinfo.output_components;
 
-	if(output->Malloc(width, height) != SUCCESS) 
+	// Region of interest, only the iMCU columns and the lines that cover it are decoded
+	x = y = skip = 0;
+	w = width;
+	h = height;
+	stride = width;
+	cropped = false;
+#ifdef LIBJPEG_TURBO_VERSION
+	if(options != NULL && options->Crop(orientation >= 5 ? height : width, orientation >= 5 ? width : height, &crop_x, &crop_y, &crop_w, &crop_h)){
+		x = crop_x;
+		y = crop_y;
+		w = crop_w;
+		h = crop_h;
+		jpeg_orient_rect(orientation, width, height, &x, &y, &w, &h);
+		// A couple of extra columns keep the upsampled chroma at the edges the same as in a full decode
+		left = x > 0 ? x - 1 : 0;
+		columns = (x + w + 2 < width ? x + w + 2 : width) - left;
+		jpeg_crop_scanline(&cinfo, &left, &columns);
+		skip = x - left;
+		stride = cinfo.output_width;
+		if(y > 0 && jpeg_skip_scanlines(&cinfo, y) != y)
+			longjmp(jerr.setjmp_buffer, 1);
+		cropped = true;
+	}
+#endif
+
+	if(output->Malloc(orientation >= 5 ? h : w, orientation >= 5 ? w : h) != SUCCESS)
 		longjmp(jerr.setjmp_buffer, 1);
 
-	while((line = cinfo.output_scanline) < height){
-		row_pointer[0] = (JSAMPROW) output->data[line];
-		jpeg_read_scanlines(&cinfo, row_pointer, 1);
+	// Scanlines go straight to their upright position, no separate rotate pass
+	if(!cropped && orientation < 5){
+		while((line = cinfo.output_scanline) < h){
+			if(orientation == 3 || orientation == 4) line = h - 1 - line;
+			row_pointer[0] = (JSAMPROW) output->data[line];
+			jpeg_read_scanlines(&cinfo, row_pointer, 1);
+			if(orientation == 2 || orientation == 3) jpeg_mirror_row(output->data[line], w);
+		}
+	}else{
+		if((block = (Pixel *) malloc(sizeof(Pixel) * stride * JPEG_ORIENT_BLOCK)) == NULL)
+			longjmp(jerr.setjmp_buffer, 1);
+		for(i = 0; i < JPEG_ORIENT_BLOCK; i++)
+			row_pointer[i] = (JSAMPROW) (block + i * stride);
+
+		for(line = 0; line < h; line += lines){
+			lines = 0;
+			while(lines < JPEG_ORIENT_BLOCK && line + lines < h){
+				i = jpeg_read_scanlines(&cinfo, row_pointer + lines, (JDIMENSION) (JPEG_ORIENT_BLOCK < h - line ? JPEG_ORIENT_BLOCK : h - line) - lines);
+				if(i == 0)
+					longjmp(jerr.setjmp_buffer, 1);
+				lines += i;
+			}
+			if(orientation >= 5){
+				jpeg_transpose_block(output, block + skip, stride, lines, line, w, h, orientation);
+				continue;
+			}
+			for(i = 0, src = block + skip; i < (int) lines; i++, src += stride){
+				y = orientation == 3 || orientation == 4 ? h - 1 - line - i : line + i;
+				memcpy(output->data[y], src, sizeof(Pixel) * w);
+				if(orientation == 2 || orientation == 3) jpeg_mirror_row(output->data[y], w);
+			}
+		}
+		free(block);
+		block = NULL;
 	}
 	output->type = SOLID;
 
-	jpeg_finish_decompress(&cinfo);
+	// Lines below the region are never decoded
+	if(cinfo.output_scanline < cinfo.output_height){
+		jpeg_abort_decompress(&cinfo);
+	}else{
+		jpeg_finish_decompress(&cinfo);
+	}
 	jpeg_destroy_decompress(&cinfo);
 
+	if(cropped)
+		options->cropped = true;
 	return SUCCESS;
 } // }}}
 
-ENCODER_FN(Jpeg){ // {{{
+DECODER_FN(Jpeg){ // {{{
+	return jpeg_decode(output, input->data, input->length, options, 0);
+} // }}}
+
+struct jpeg_image_destination_mgr {
+	struct jpeg_destination_mgr pub;
+	ImageData *output;
+	size_t estimate;
+	bool limited; // fail instead of growing the output
+};
+
+void jpeg_image_init_destination(j_compress_ptr cinfo){ // {{{
+	struct jpeg_image_destination_mgr *dest;
+	ImageData *output;
+
+	dest = (struct jpeg_image_destination_mgr *) cinfo->dest;
+	output = dest->output;
+
+	output->Estimate(dest->estimate);
+	if(output->position == output->length && output->Expand() != SUCCESS)
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+
+	dest->pub.next_output_byte = output->data + output->position;
+	dest->pub.free_in_buffer = output->length - output->position;
+} // }}}
+
+boolean jpeg_image_empty_output_buffer(j_compress_ptr cinfo){ // {{{
+	struct jpeg_image_destination_mgr *dest;
+	ImageData *output;
+
+	dest = (struct jpeg_image_destination_mgr *) cinfo->dest;
+	output = dest->output;
+
+	// libjpeg only calls us once the whole buffer is used
+	if(dest->limited)
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+	output->position = output->length;
+	if(output->Expand() != SUCCESS)
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+
+	dest->pub.next_output_byte = output->data + output->position;
+	dest->pub.free_in_buffer = output->length - output->position;
+	return TRUE;
+} // }}}
+
+void jpeg_image_term_destination(j_compress_ptr cinfo){ // {{{
+	struct jpeg_image_destination_mgr *dest;
+
+	dest = (struct jpeg_image_destination_mgr *) cinfo->dest;
+	dest->output->position = dest->output->length - dest->pub.free_in_buffer;
+} // }}}
+
+// Encode from RGBA rows, or from packed YCbCr rows when ycc is given.
+// A limited encode stops as soon as the output buffer is full
+ImageState jpeg_encode(PixelArray *input, JSAMPLE *ycc, ImageData *output, int quality, bool limited){ // {{{
 	struct jpeg_compress_struct cinfo;
 	struct my_jpeg_error_mgr jerr;
-	jpeg_compress_config *conf;
+	struct jpeg_image_destination_mgr dest;
 
 	int width, height, line;
 	JSAMPROW row_pointer[1];
@@ -134,33 +491,323 @@ ENCODER_FN(Jpeg){ // {{{
 	}
 
 	jpeg_create_compress(&cinfo);
-	jpeg_mem_dest(&cinfo, (unsigned char **) &(output->data), &output->length);
-
 	width = input->width;
 	height = input->height;
-	conf = get_compress_config(config);
 
 	cinfo.image_width = width;
 	cinfo.image_height = height;
-	cinfo.input_components = 4;
-	cinfo.in_color_space = JCS_EXT_RGBA;
+	cinfo.input_components = ycc != NULL ? 3 : 4;
+	cinfo.in_color_space = ycc != NULL ? JCS_YCbCr : JCS_EXT_RGBA;
 
 	jpeg_set_defaults(&cinfo);
 	
-	jpeg_set_quality(&cinfo, conf->quality, TRUE);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	// Write straight into the output, pre-sized from a rough compression ratio
+	dest.pub.init_destination = jpeg_image_init_destination;
+	dest.pub.empty_output_buffer = jpeg_image_empty_output_buffer;
+	dest.pub.term_destination = jpeg_image_term_destination;
+	dest.output = output;
+	dest.estimate = (size_t) width * height * 3 / (quality >= 90 ? 16 : 32);
+	dest.limited = limited;
+	cinfo.dest = &dest.pub;
 
 	jpeg_start_compress(&cinfo, TRUE);
 
 	//printf("%d %s\n", cinfo.input_components, cinfo.in_color_space == JCS_EXT_RGBA ? "true" : "false");
 
 	while((line = cinfo.next_scanline) < height){
-		row_pointer[0] = (JSAMPROW) input->data[line];
+		row_pointer[0] = ycc != NULL ? ycc + (size_t) line * width * 3 : (JSAMPROW) input->data[line];
 		(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
 	}
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
 
-	output->position = output->length;
+	return SUCCESS;
+} // }}}
+
+// Same fixed point RGB to YCbCr as libjpeg, so the result matches a direct encode
+#define JPEG_YCC_FIX(x) ((int32_t) ((x) * 65536 + 0.5))
+#define JPEG_YCC_HALF ((int32_t) 1 << 15)
+#define JPEG_YCC_OFFSET ((int32_t) 128 << 16)
+
+void jpeg_rgb_ycc(PixelArray *input, JSAMPLE *ycc){ // {{{
+	size_t x, y;
+	Pixel *p;
+
+	for(y = 0; y < input->height; y++){
+		p = input->data[y];
+		for(x = 0; x < input->width; x++, p++, ycc += 3){
+			ycc[0] = (JPEG_YCC_FIX(0.29900) * p->R + JPEG_YCC_FIX(0.58700) * p->G + JPEG_YCC_FIX(0.11400) * p->B + JPEG_YCC_HALF) >> 16;
+			ycc[1] = (-JPEG_YCC_FIX(0.16874) * p->R - JPEG_YCC_FIX(0.33126) * p->G + JPEG_YCC_FIX(0.5) * p->B + JPEG_YCC_OFFSET + JPEG_YCC_HALF - 1) >> 16;
+			ycc[2] = (JPEG_YCC_FIX(0.5) * p->R - JPEG_YCC_FIX(0.41869) * p->G - JPEG_YCC_FIX(0.08131) * p->B + JPEG_YCC_OFFSET + JPEG_YCC_HALF - 1) >> 16;
+		}
+	}
+} // }}}
+
+// Highest quality up to the configured one whose output fits in max_bytes.
+// The colour conversion is done once and shared by every attempt, and an
+// attempt stops as soon as it overflows
+ImageState jpeg_encode_max_bytes(PixelArray *input, ImageData *output, int quality, size_t max_bytes){ // {{{
+	JSAMPLE *ycc;
+	ImageData best, trial, swap;
+	int lo, hi, q;
+	ImageState ret;
+
+	if((ycc = (JSAMPLE *) malloc(input->width * input->height * 3)) == NULL)
+		return Image::setError("Out of memory.");
+	jpeg_rgb_ycc(input, ycc);
+
+	memset(&best, 0x00, sizeof(ImageData));
+	memset(&trial, 0x00, sizeof(ImageData));
+	best.length = trial.length = max_bytes;
+	best.fixed = trial.fixed = true;
+	best.data = (uint8_t *) malloc(max_bytes);
+	trial.data = (uint8_t *) malloc(max_bytes);
+
+	ret = FAIL;
+	if(best.data != NULL && trial.data != NULL){
+		// Try the requested quality first, then bisect below it
+		lo = 1;
+		hi = quality;
+		q = hi;
+		while(lo <= hi){
+			trial.position = 0;
+			if(jpeg_encode(input, ycc, &trial, q, true) == SUCCESS){
+				swap = best;
+				best = trial;
+				trial = swap;
+				ret = SUCCESS;
+				lo = q + 1;
+			}else{
+				hi = q - 1;
+			}
+			q = (lo + hi) / 2;
+		}
+
+		if(ret == SUCCESS){
+			ret = output->Write(best.data, best.position);
+		}else{
+			Image::setError("Can't encode within maxBytes.");
+		}
+	}else{
+		Image::setError("Out of memory.");
+	}
+
+	free(best.data);
+	free(trial.data);
+	free(ycc);
+	return ret;
+} // }}}
+
+ENCODER_FN(Jpeg){ // {{{
+	jpeg_compress_config *conf;
+	size_t max_bytes;
+
+	conf = get_compress_config(config);
+	max_bytes = JPEG_U32(conf->max_bytes);
+	if(max_bytes > 0)
+		return jpeg_encode_max_bytes(input, output, conf->quality < 1 ? 1 : conf->quality, max_bytes);
+
+	return jpeg_encode(input, NULL, output, conf->quality, false);
+} // }}}
+
+// Lossless transforms, done on the DCT coefficients like jpegtran
+
+void jpeg_transform_block(JCOEFPTR src, JCOEFPTR dst, JpegTransform *transform){ // {{{
+	int r, c;
+	JCOEF v;
+
+	// Transposing swaps the frequencies, mirroring negates the odd ones along that axis
+	for(r = 0; r < DCTSIZE; r++){
+		for(c = 0; c < DCTSIZE; c++){
+			v = transform->transpose ? src[c * DCTSIZE + r] : src[r * DCTSIZE + c];
+			if((transform->mirror_x && (c & 1)) != (transform->mirror_y && (r & 1))) v = -v;
+			dst[r * DCTSIZE + c] = v;
+		}
+	}
+} // }}}
+
+ImageState jpegTransform(ImageData *input, ImageData *output, JpegTransform *transform, ImageDecodeOptions *options){ // {{{
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct my_jpeg_error_mgr jerr;
+	struct jpeg_image_destination_mgr dest;
+	jpeg_component_info *scomp, *dcomp;
+	jpeg_saved_marker_ptr marker;
+	jvirt_barray_ptr *src_coef, *dst_coef;
+	JBLOCKARRAY src_rows, dst_rows;
+	JQUANT_TBL *qtbl;
+
+	size_t swap, width, height, imcu_w, imcu_h, crop_x, crop_y, crop_w, crop_h;
+	size_t full_w, full_h, off_x, off_y, bx, by, ox, oy, sx, sy;
+	int ci, i, r, c, max_h, max_v, k;
+	bool flip_x, flip_y;
+
+	memset(&src, 0x00, sizeof(src));
+	memset(&dst, 0x00, sizeof(dst));
+	src.err = jpeg_std_error(&jerr.pub);
+	dst.err = &jerr.pub;
+	jerr.pub.error_exit = jpeg_cb_error_exit;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		return FAIL;
+	}
+
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+	jpeg_mem_src(&src, (unsigned char *) input->data, input->length);
+	jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+	for(i = 1; i < 16; i++)
+		jpeg_save_markers(&src, JPEG_APP0 + i, 0xFFFF);
+	jpeg_read_header(&src, TRUE);
+	if(Image::checkSize(src.image_width, src.image_height, options) != SUCCESS){
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		return FAIL;
+	}
+
+	// Mirrored source axes can only move whole iMCUs, the partial edge is trimmed
+	max_h = src.max_h_samp_factor;
+	max_v = src.max_v_samp_factor;
+	imcu_w = max_h * DCTSIZE;
+	imcu_h = max_v * DCTSIZE;
+	flip_x = transform->transpose ? transform->mirror_y : transform->mirror_x;
+	flip_y = transform->transpose ? transform->mirror_x : transform->mirror_y;
+	width = flip_x ? src.image_width - src.image_width % imcu_w : src.image_width;
+	height = flip_y ? src.image_height - src.image_height % imcu_h : src.image_height;
+	if(width == 0 || height == 0){
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		return Image::setError("Image too small for the transform.");
+	}
+
+	if(transform->transpose){
+		swap = width; width = height; height = swap;
+		swap = imcu_w; imcu_w = imcu_h; imcu_h = swap;
+		swap = max_h; max_h = max_v; max_v = swap;
+	}
+
+	// Crop in output coordinates, the origin moves back to an iMCU boundary
+	crop_x = crop_y = 0;
+	crop_w = width;
+	crop_h = height;
+	if(transform->crop_width > 0 && transform->crop_height > 0){
+		if(transform->crop_x >= width || transform->crop_y >= height){
+			jpeg_destroy_compress(&dst);
+			jpeg_destroy_decompress(&src);
+			return Image::setError("Crop outside of the image.");
+		}
+		crop_x = transform->crop_x - transform->crop_x % imcu_w;
+		crop_y = transform->crop_y - transform->crop_y % imcu_h;
+		crop_w = transform->crop_width + transform->crop_x - crop_x;
+		crop_h = transform->crop_height + transform->crop_y - crop_y;
+		if(crop_w > width - crop_x) crop_w = width - crop_x;
+		if(crop_h > height - crop_y) crop_h = height - crop_y;
+	}
+
+	// Destination arrays, in whole iMCUs of the output
+	dst_coef = (jvirt_barray_ptr *) (*src.mem->alloc_small)((j_common_ptr) &src, JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * src.num_components);
+	for(ci = 0; ci < src.num_components; ci++){
+		scomp = src.comp_info + ci;
+		r = transform->transpose ? scomp->h_samp_factor : scomp->v_samp_factor;
+		c = transform->transpose ? scomp->v_samp_factor : scomp->h_samp_factor;
+		dst_coef[ci] = (*src.mem->request_virt_barray)((j_common_ptr) &src, JPOOL_IMAGE, FALSE,
+			(JDIMENSION) ((crop_w + imcu_w - 1) / imcu_w * c),
+			(JDIMENSION) ((crop_h + imcu_h - 1) / imcu_h * r), (JDIMENSION) r);
+	}
+
+	src_coef = jpeg_read_coefficients(&src);
+
+	jpeg_copy_critical_parameters(&src, &dst);
+	dst.image_width = crop_w;
+	dst.image_height = crop_h;
+	dst.optimize_coding = TRUE;
+	if(transform->transpose){
+		for(ci = 0; ci < dst.num_components; ci++){
+			dcomp = dst.comp_info + ci;
+			k = dcomp->h_samp_factor;
+			dcomp->h_samp_factor = dcomp->v_samp_factor;
+			dcomp->v_samp_factor = k;
+		}
+		for(i = 0; i < NUM_QUANT_TBLS; i++){
+			if((qtbl = dst.quant_tbl_ptrs[i]) == NULL) continue;
+			for(r = 0; r < DCTSIZE; r++){
+				for(c = r + 1; c < DCTSIZE; c++){
+					k = qtbl->quantval[r * DCTSIZE + c];
+					qtbl->quantval[r * DCTSIZE + c] = qtbl->quantval[c * DCTSIZE + r];
+					qtbl->quantval[c * DCTSIZE + r] = k;
+				}
+			}
+		}
+	}
+
+	for(ci = 0; ci < dst.num_components; ci++){
+		scomp = src.comp_info + ci;
+		dcomp = dst.comp_info + ci;
+
+		// Size of the whole transformed component and the crop offset, in blocks
+		full_w = (width * dcomp->h_samp_factor + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+		full_h = (height * dcomp->v_samp_factor + max_v * DCTSIZE - 1) / (max_v * DCTSIZE);
+		off_x = crop_x / imcu_w * dcomp->h_samp_factor;
+		off_y = crop_y / imcu_h * dcomp->v_samp_factor;
+
+		for(by = 0; by < (crop_h + imcu_h - 1) / imcu_h * dcomp->v_samp_factor; by += dcomp->v_samp_factor){
+			dst_rows = (*src.mem->access_virt_barray)((j_common_ptr) &src, dst_coef[ci], by, dcomp->v_samp_factor, TRUE);
+			for(k = 0; k < dcomp->v_samp_factor; k++){
+				for(bx = 0; bx < (crop_w + imcu_w - 1) / imcu_w * dcomp->h_samp_factor; bx++){
+					ox = bx + off_x;
+					oy = by + k + off_y;
+
+					// Padding blocks past the real image
+					if(ox >= full_w || oy >= full_h){
+						memset(dst_rows[k][bx], 0x00, sizeof(JBLOCK));
+						continue;
+					}
+					if(transform->mirror_x) ox = full_w - 1 - ox;
+					if(transform->mirror_y) oy = full_h - 1 - oy;
+					sx = transform->transpose ? oy : ox;
+					sy = transform->transpose ? ox : oy;
+					if(sx >= scomp->width_in_blocks || sy >= scomp->height_in_blocks){
+						memset(dst_rows[k][bx], 0x00, sizeof(JBLOCK));
+						continue;
+					}
+					src_rows = (*src.mem->access_virt_barray)((j_common_ptr) &src, src_coef[ci], sy, 1, FALSE);
+					jpeg_transform_block(src_rows[0][sx], dst_rows[k][bx], transform);
+				}
+			}
+		}
+	}
+
+	dest.pub.init_destination = jpeg_image_init_destination;
+	dest.pub.empty_output_buffer = jpeg_image_empty_output_buffer;
+	dest.pub.term_destination = jpeg_image_term_destination;
+	dest.output = output;
+	dest.estimate = input->length;
+	dest.limited = false;
+	dst.dest = &dest.pub;
+
+	jpeg_write_coefficients(&dst, dst_coef);
+
+	// Keep the metadata, except what the library writes itself. Like jpegtran the EXIF
+	// orientation is left alone, it still applies on top of the transformed picture
+	for(marker = src.marker_list; marker != NULL; marker = marker->next){
+		if(dst.write_JFIF_header && marker->marker == JPEG_APP0 && marker->data_length >= 5
+		&& memcmp(marker->data, "JFIF", 5) == 0)
+			continue;
+		if(dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5
+		&& memcmp(marker->data, "Adobe", 5) == 0)
+			continue;
+		jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	(void) jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+
 	return SUCCESS;
 } // }}}
 
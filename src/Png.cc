@@ -65,14 +65,11 @@ void read_from_memory(png_structp png_ptr, png_bytep buffer, png_size_t size){ /
     img->position += size;
 } // }}}
 
-#define PNG_INIT_FILE_SIZE 1024
-#define PNG_BIG_FILE_SIZE 10240
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
 
 void write_to_memory(png_structp png_ptr, png_bytep buffer, png_size_t size){ // {{{
     ImageData *img;
-    size_t len;
 
     img = (ImageData *) png_get_io_ptr(png_ptr);
     if(img == NULL){
@@ -80,25 +77,10 @@ void write_to_memory(png_structp png_ptr, png_bytep buffer, png_size_t size){ //
         return;
     }
 
-    if(img->data == NULL){
-        len = PNG_INIT_FILE_SIZE + size;
-        if((img->data = (uint8_t *) malloc(len)) == NULL){
-            png_error(png_ptr, "Out of memory.");
-            return;
-        }
-        img->length = len;
-        img->position = 0;
-    }else if((len = img->position + size) > img->length){
-        len = (len < PNG_BIG_FILE_SIZE) ? (len << 1) :(len + PNG_INIT_FILE_SIZE);
-        if((img->data = (uint8_t *) realloc(img->data, len)) == NULL){
-            png_error(png_ptr, "Out of memory.");
-            return;
-        }
-        img->length = len;
+    if(img->Write(buffer, size) != SUCCESS){
+        png_error(png_ptr, "Write fail.");
+        return;
     }
-
-    memcpy(&(img->data[img->position]), buffer, size);
-    img->position += size;
 } // }}}
 
 void flush_memory(png_structp png_ptr){ // {{{
@@ -106,31 +88,66 @@ void flush_memory(png_structp png_ptr){ // {{{
 } // }}}
 
 #define PNG_BYTES_TO_CHECK 4
+#define PNG_IHDR_END 24 // signature, chunk length and type, width and height
+
+#define PNG_CONFIG_DEFAULT 0xFF
+
+typedef struct {
+    char P;
+    char N;
+    char G;
+    char _;
+    uint8_t level;       // zlib compression level, 0-9
+    uint8_t mem_level;   // zlib memLevel, 1-9
+    uint8_t window_bits; // zlib window bits, 8-15
+    uint8_t strategy;    // Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED
+    uint8_t filters;     // PNG_FILTER_* mask
+    uint8_t color_type;  // PNG_COLOR_TYPE_*, PNG_CONFIG_DEFAULT picks the smallest one
+} png_compress_config;
+
+png_compress_config default_png_compress_config = {
+    'P','N','G',' ',
+    PNG_CONFIG_DEFAULT,
+    PNG_CONFIG_DEFAULT,
+    PNG_CONFIG_DEFAULT,
+    PNG_CONFIG_DEFAULT,
+    PNG_CONFIG_DEFAULT,
+    PNG_CONFIG_DEFAULT,
+};
+
+png_compress_config *get_png_compress_config(ImageConfig *config){ // {{{
+    if(config == NULL || config->data == NULL
+    || config->length != sizeof(png_compress_config)
+    || config->data[0] != default_png_compress_config.P
+    || config->data[1] != default_png_compress_config.N
+    || config->data[2] != default_png_compress_config.G
+    || config->data[3] != default_png_compress_config._)
+        return &default_png_compress_config;
+
+    return (png_compress_config *) config->data;
+} // }}}
 
-DECODER_FN(Png){ // {{{
-    png_structp png_ptr;
-    png_infop info_ptr;
+void set_png_compress_config(png_structp png_ptr, png_compress_config *conf){ // {{{
+    if(conf->level != PNG_CONFIG_DEFAULT)
+        png_set_compression_level(png_ptr, MIN(conf->level, 9));
 
-    png_uint_32 width, height;
-    int bit_depth, color_type, interlace_type;
+    if(conf->mem_level != PNG_CONFIG_DEFAULT)
+        png_set_compression_mem_level(png_ptr, MAX(MIN(conf->mem_level, 9), 1));
 
-    if(input->length < PNG_BYTES_TO_CHECK) return FAIL;
-    if(png_sig_cmp(input->data, 0, PNG_BYTES_TO_CHECK)) return FAIL;
-    if((png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) return FAIL;
+    if(conf->window_bits != PNG_CONFIG_DEFAULT)
+        png_set_compression_window_bits(png_ptr, MAX(MIN(conf->window_bits, 15), 8));
 
-    if((info_ptr = png_create_info_struct(png_ptr)) == NULL){
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
-        return FAIL;
-    }
+    if(conf->strategy != PNG_CONFIG_DEFAULT)
+        png_set_compression_strategy(png_ptr, MIN(conf->strategy, 4));
 
-    if (setjmp(png_jmpbuf(png_ptr))){
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return FAIL;
-    }
+    if(conf->filters != PNG_CONFIG_DEFAULT)
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, conf->filters & PNG_ALL_FILTERS);
+} // }}}
 
-    png_set_read_fn(png_ptr, (void *) input, read_from_memory);
+int png_set_rgba_transforms(png_structp png_ptr, png_infop info_ptr){ // {{{
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace_type, passes;
 
-    png_read_info(png_ptr, info_ptr);
     png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
                  &interlace_type, NULL, NULL);
 
@@ -158,16 +175,82 @@ DECODER_FN(Png){ // {{{
     if(bit_depth == 16)
         png_set_strip_16(png_ptr);
 
-    png_set_interlace_handling(png_ptr);
+    passes = png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr,info_ptr);
 
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+    if(png_get_rowbytes(png_ptr,info_ptr) != png_get_image_width(png_ptr, info_ptr) * sizeof(Pixel)){
+        return 0;
+    }
 
-    if(png_get_rowbytes(png_ptr,info_ptr) != width * sizeof(Pixel)){
+    return passes;
+} // }}}
+
+// Width and height straight from IHDR, so the size limit is checked before libpng allocates anything
+ImageState png_check_size(ImageData *input, ImageDecodeOptions *options){ // {{{
+    uint8_t *ihdr;
+
+    if(input->length < PNG_IHDR_END || memcmp(input->data + 12, "IHDR", 4) != 0) return SUCCESS;
+    ihdr = input->data + 16;
+    return Image::checkSize(png_get_uint_32(ihdr), png_get_uint_32(ihdr + 4), options);
+} // }}}
+
+DECODER_FN(Png){ // {{{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep volatile row = NULL;
+    size_t width, height, x, y, w, h, i;
+    int passes;
+
+    if(input->length < PNG_BYTES_TO_CHECK) return FAIL;
+    if(png_sig_cmp(input->data, 0, PNG_BYTES_TO_CHECK)) return FAIL;
+    if(png_check_size(input, options) != SUCCESS) return FAIL;
+    if((png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) return FAIL;
+
+    if((info_ptr = png_create_info_struct(png_ptr)) == NULL){
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return FAIL;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))){
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(row);
+        output->Free();
+        return FAIL;
+    }
+
+    png_set_read_fn(png_ptr, (void *) input, read_from_memory);
+
+    png_read_info(png_ptr, info_ptr);
+
+    if((passes = png_set_rgba_transforms(png_ptr, info_ptr)) == 0){
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return FAIL;
     }
 
+    width = png_get_image_width(png_ptr, info_ptr);
+    height = png_get_image_height(png_ptr, info_ptr);
+
+    // Region of a non-interlaced image, rows are read one by one and
+    // decompression stops after the last row of the region
+    if(passes == 1 && options != NULL && options->Crop(width, height, &x, &y, &w, &h)){
+        if(output->Malloc(w, h) != SUCCESS || (row = (png_bytep) malloc(width * sizeof(Pixel))) == NULL){
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            output->Free();
+            return FAIL;
+        }
+        for(i = 0; i < y + h; i++){
+            png_read_row(png_ptr, row, NULL);
+            if(i >= y)
+                memcpy(output->data[i - y], row + x * sizeof(Pixel), w * sizeof(Pixel));
+        }
+        free(row);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+        options->cropped = true;
+        output->DetectTransparent();
+        return SUCCESS;
+    }
+
     if(output->Malloc(width, height) != SUCCESS){
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return FAIL;
@@ -181,34 +264,363 @@ DECODER_FN(Png){ // {{{
     return SUCCESS;
 } // }}}
 
+typedef struct {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int passes;
+} png_stream_context;
+
+void png_stream_info(png_structp png_ptr, png_infop info_ptr){ // {{{
+    ImageStream *stream;
+    png_stream_context *ctx;
+
+    stream = (ImageStream *) png_get_progressive_ptr(png_ptr);
+    ctx = (png_stream_context *) stream->context;
+
+    if((ctx->passes = png_set_rgba_transforms(png_ptr, info_ptr)) == 0)
+        png_error(png_ptr, "Unsupported format.");
+
+    if(Image::checkSize(png_get_image_width(png_ptr, info_ptr), png_get_image_height(png_ptr, info_ptr), stream->options) != SUCCESS)
+        png_error(png_ptr, "Beyond the size limit.");
+
+    if(stream->output->Malloc(png_get_image_width(png_ptr, info_ptr), png_get_image_height(png_ptr, info_ptr)) != SUCCESS)
+        png_error(png_ptr, "Out of memory.");
+} // }}}
+
+void png_stream_row(png_structp png_ptr, png_bytep row, png_uint_32 row_num, int pass){ // {{{
+    ImageStream *stream;
+    png_stream_context *ctx;
+
+    stream = (ImageStream *) png_get_progressive_ptr(png_ptr);
+    ctx = (png_stream_context *) stream->context;
+
+    if(row == NULL || row_num >= stream->output->height) return;
+
+    // Interlaced rows are only complete after the last pass
+    png_progressive_combine_row(png_ptr, (png_bytep) stream->output->data[row_num], row);
+    if(pass == ctx->passes - 1 || ctx->passes == 1)
+        stream->rows = row_num + 1;
+} // }}}
+
+void png_stream_end(png_structp png_ptr, png_infop info_ptr){ // {{{
+    ImageStream *stream;
+
+    stream = (ImageStream *) png_get_progressive_ptr(png_ptr);
+    stream->rows = stream->output->height;
+    stream->output->DetectTransparent();
+    stream->done = true;
+} // }}}
+
+ImageState png_stream_open(ImageStream *stream, ImageData *input){ // {{{
+    png_stream_context *ctx;
+
+    if(input->length < PNG_BYTES_TO_CHECK) return FAIL;
+    if(png_sig_cmp(input->data, 0, PNG_BYTES_TO_CHECK)) return FAIL;
+    if(png_check_size(input, stream->options) != SUCCESS) return FAIL;
+    if((ctx = (png_stream_context *) malloc(sizeof(png_stream_context))) == NULL) return FAIL;
+
+    if((ctx->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL){
+        free(ctx);
+        return FAIL;
+    }
+
+    if((ctx->info_ptr = png_create_info_struct(ctx->png_ptr)) == NULL){
+        png_destroy_read_struct(&ctx->png_ptr, NULL, NULL);
+        free(ctx);
+        return FAIL;
+    }
+
+    ctx->passes = 1;
+    stream->context = ctx;
+    png_set_progressive_read_fn(ctx->png_ptr, (void *) stream, png_stream_info, png_stream_row, png_stream_end);
+    return SUCCESS;
+} // }}}
+
+ImageState png_stream_write(ImageStream *stream, ImageData *input){ // {{{
+    png_stream_context *ctx;
+
+    ctx = (png_stream_context *) stream->context;
+
+    if (setjmp(png_jmpbuf(ctx->png_ptr))){
+        return FAIL;
+    }
+
+    png_process_data(ctx->png_ptr, ctx->info_ptr, input->data, input->length);
+    return SUCCESS;
+} // }}}
+
+void png_stream_close(ImageStream *stream){ // {{{
+    png_stream_context *ctx;
+
+    ctx = (png_stream_context *) stream->context;
+    png_destroy_read_struct(&ctx->png_ptr, &ctx->info_ptr, NULL);
+    free(ctx);
+    stream->context = NULL;
+} // }}}
+
+ImageStreamDecoder STREAM_DECODER(Png) = {
+    png_stream_open,
+    png_stream_write,
+    png_stream_close,
+};
+
+#define PNG_PALETTE_SIZE 256
+#define PNG_PALETTE_HASH_BITS 10
+#define PNG_PALETTE_HASH_SIZE (1 << PNG_PALETTE_HASH_BITS)
+
+typedef struct {
+    bool alpha;
+    bool gray;
+    int colors; // distinct colors, PNG_PALETTE_SIZE + 1 means too many
+    uint32_t keys[PNG_PALETTE_HASH_SIZE];
+    int16_t index[PNG_PALETTE_HASH_SIZE];
+    png_color palette[PNG_PALETTE_SIZE];
+    png_byte trans[PNG_PALETTE_SIZE];
+    int num_trans;
+} png_color_stats;
+
+inline uint32_t png_pixel_key(Pixel *pixel){
+    return (uint32_t) pixel->R << 24 | pixel->G << 16 | pixel->B << 8 | pixel->A;
+}
+
+inline int16_t *png_palette_slot(png_color_stats *stats, uint32_t key){ // {{{
+    uint32_t slot;
+
+    slot = (key * 2654435761U) >> (32 - PNG_PALETTE_HASH_BITS);
+    while(stats->index[slot] != -1 && stats->keys[slot] != key){
+        slot = (slot + 1) & (PNG_PALETTE_HASH_SIZE - 1);
+    }
+    stats->keys[slot] = key;
+    return &(stats->index[slot]);
+} // }}}
+
+void png_analyse_colors(PixelArray *input, png_color_stats *stats){ // {{{
+    size_t x, y;
+    Pixel *pixel;
+    uint32_t key, last;
+    int16_t *index;
+    bool check_alpha;
+
+    // Trust the transparency detected by the decoders, skip the alpha test for opaque images
+    check_alpha = input->type != SOLID;
+    stats->alpha = false;
+    stats->gray = true;
+    stats->colors = 0;
+    memset(stats->index, 0xFF, sizeof(stats->index));
+
+    last = 0;
+    for(y = 0; y < input->height; y++){
+        pixel = input->data[y];
+        for(x = 0; x < input->width; x++, pixel++){
+            if(check_alpha && pixel->A != 0xFF)
+                stats->alpha = true;
+
+            if(stats->gray && (pixel->R != pixel->G || pixel->G != pixel->B))
+                stats->gray = false;
+
+            if(stats->colors <= PNG_PALETTE_SIZE){
+                key = png_pixel_key(pixel);
+                if(stats->colors == 0 || key != last){
+                    index = png_palette_slot(stats, key);
+                    if(*index == -1){
+                        if(stats->colors < PNG_PALETTE_SIZE){
+                            *index = stats->colors;
+                        }
+                        stats->colors++;
+                    }
+                    last = key;
+                }
+            }else if(!stats->gray && (stats->alpha || !check_alpha)){
+                // Nothing left to learn
+                return;
+            }
+        }
+    }
+} // }}}
+
+void png_build_palette(png_color_stats *stats){ // {{{
+    int16_t order[PNG_PALETTE_SIZE];
+    uint32_t keys[PNG_PALETTE_SIZE];
+    int i, n, slot;
+    uint32_t key;
+
+    for(slot = 0; slot < PNG_PALETTE_HASH_SIZE; slot++){
+        if(stats->index[slot] != -1)
+            keys[stats->index[slot]] = stats->keys[slot];
+    }
+
+    // Translucent entries first, so the tRNS chunk can stop at the last one
+    n = 0;
+    for(i = 0; i < stats->colors; i++)
+        if((keys[i] & 0xFF) != 0xFF) order[i] = n++;
+    stats->num_trans = n;
+    for(i = 0; i < stats->colors; i++)
+        if((keys[i] & 0xFF) == 0xFF) order[i] = n++;
+
+    for(i = 0; i < stats->colors; i++){
+        key = keys[i];
+        n = order[i];
+        stats->palette[n].red = key >> 24;
+        stats->palette[n].green = (key >> 16) & 0xFF;
+        stats->palette[n].blue = (key >> 8) & 0xFF;
+        stats->trans[n] = key & 0xFF;
+    }
+
+    for(slot = 0; slot < PNG_PALETTE_HASH_SIZE; slot++){
+        if(stats->index[slot] != -1)
+            stats->index[slot] = order[stats->index[slot]];
+    }
+} // }}}
+
+int png_choose_color_type(png_color_stats *stats, int color_type){ // {{{
+    switch(color_type){
+        case PNG_COLOR_TYPE_GRAY:
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+        case PNG_COLOR_TYPE_RGB:
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            return color_type;
+        case PNG_COLOR_TYPE_PALETTE:
+            if(stats->colors <= PNG_PALETTE_SIZE) return PNG_COLOR_TYPE_PALETTE;
+            return stats->alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+        default:
+            if(stats->gray && !stats->alpha) return PNG_COLOR_TYPE_GRAY;
+            if(stats->colors <= PNG_PALETTE_SIZE) return PNG_COLOR_TYPE_PALETTE;
+            if(stats->gray) return PNG_COLOR_TYPE_GRAY_ALPHA;
+            return stats->alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+    }
+} // }}}
+
+inline png_byte png_pixel_gray(Pixel *pixel){
+    return (png_byte) ((pixel->R * 77 + pixel->G * 150 + pixel->B * 29) >> 8);
+}
+
+void png_convert_row(png_color_stats *stats, Pixel *pixel, png_bytep row, size_t width, int color_type){ // {{{
+    size_t x;
+    uint32_t key, last;
+    png_byte index;
+
+    switch(color_type){
+        case PNG_COLOR_TYPE_GRAY:
+            for(x = 0; x < width; x++, pixel++)
+                *row++ = png_pixel_gray(pixel);
+            break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            for(x = 0; x < width; x++, pixel++){
+                *row++ = png_pixel_gray(pixel);
+                *row++ = pixel->A;
+            }
+            break;
+        case PNG_COLOR_TYPE_PALETTE:
+            last = index = 0;
+            for(x = 0; x < width; x++, pixel++){
+                key = png_pixel_key(pixel);
+                if(x == 0 || key != last){
+                    index = (png_byte) *png_palette_slot(stats, key);
+                    last = key;
+                }
+                *row++ = index;
+            }
+            break;
+    }
+} // }}}
+
 ENCODER_FN(Png){ // {{{
     png_structp png_ptr;
     png_infop info_ptr;
+    png_compress_config *conf;
+    png_color_stats *stats;
+    png_bytep row;
+    size_t y;
+    int color_type, bit_depth;
+
+    conf = get_png_compress_config(config);
+    color_type = conf->color_type;
+    bit_depth = 8;
+    stats = NULL;
+    row = NULL;
+
+    if(color_type != PNG_COLOR_TYPE_GRAY && color_type != PNG_COLOR_TYPE_GRAY_ALPHA
+    && color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA){
+        if((stats = (png_color_stats *) malloc(sizeof(png_color_stats))) == NULL) return FAIL;
+        png_analyse_colors(input, stats);
+    }
+
+    switch(color_type = png_choose_color_type(stats, color_type)){
+        case PNG_COLOR_TYPE_PALETTE:
+            png_build_palette(stats);
+            bit_depth = stats->colors <= 2 ? 1 : stats->colors <= 4 ? 2 : stats->colors <= 16 ? 4 : 8;
+            // fall through
+        case PNG_COLOR_TYPE_GRAY:
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            if((row = (png_bytep) malloc(input->width * 2)) == NULL){
+                free(stats);
+                return FAIL;
+            }
+            break;
+    }
 
-    if((png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) return FAIL;
+    if((png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL){
+        free(stats);
+        free(row);
+        return FAIL;
+    }
     if((info_ptr = png_create_info_struct(png_ptr)) == NULL){
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        png_destroy_write_struct(&png_ptr, NULL);
+        free(stats);
+        free(row);
         return FAIL;
     }
 
     if (setjmp(png_jmpbuf(png_ptr))){
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(stats);
+        free(row);
         return FAIL;
     }
 
-    output->data = NULL;
     png_set_write_fn(png_ptr, (void *) output, write_to_memory, flush_memory);
+    set_png_compress_config(png_ptr, conf);
 
     //printf("%d\n", info_ptr->width);
 
-    png_set_IHDR(png_ptr, info_ptr, input->width, input->height, 8,
-                 PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+    png_set_IHDR(png_ptr, info_ptr, input->width, input->height, bit_depth,
+                 color_type, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
+    // Expect deflate to shrink the filtered rows to a quarter
+    output->Estimate((png_get_rowbytes(png_ptr, info_ptr) + 1) * input->height / 4);
+
+    if(color_type == PNG_COLOR_TYPE_PALETTE){
+        png_set_PLTE(png_ptr, info_ptr, stats->palette, stats->colors);
+        if(stats->num_trans > 0)
+            png_set_tRNS(png_ptr, info_ptr, stats->trans, stats->num_trans, NULL);
+    }
+
     png_write_info(png_ptr, info_ptr);
-    png_write_image(png_ptr, (png_bytepp) input->data);
+
+    if(bit_depth < 8)
+        png_set_packing(png_ptr);
+
+    switch(color_type){
+        case PNG_COLOR_TYPE_RGB:
+            // Let libpng drop the alpha bytes
+            png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+            // fall through
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            png_write_image(png_ptr, (png_bytepp) input->data);
+            break;
+        default:
+            for(y = 0; y < input->height; y++){
+                png_convert_row(stats, input->data[y], row, input->width, color_type);
+                png_write_row(png_ptr, row);
+            }
+            break;
+    }
+
     png_write_end(png_ptr, info_ptr);
     png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(stats);
+    free(row);
 
     return SUCCESS;
 } // }}}
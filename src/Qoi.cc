@@ -0,0 +1,254 @@
+/*
+ * Qoi.cc
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013 ZhangYuanwei <zhangyuanwei1988@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL INTEL AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Image.h"
+
+#ifdef HAVE_QOI
+
+#include <stdlib.h>
+#include <string.h>
+
+// "Quite OK Image" format, see https://qoiformat.org/qoi-specification.pdf
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+#define QOI_HASH(p) (((p).R * 3 + (p).G * 5 + (p).B * 7 + (p).A * 11) & 63)
+
+#define QOI_U32(p) ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16 | (uint32_t) (p)[2] << 8 | (uint32_t) (p)[3])
+#define QOI_SET32(p, v) do{ (p)[0] = ((v) >> 24) & 0xff; (p)[1] = ((v) >> 16) & 0xff; (p)[2] = ((v) >> 8) & 0xff; (p)[3] = (v) & 0xff; }while(0)
+
+static const uint8_t QoiPadding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+inline bool qoi_equal(Pixel *a, Pixel *b){
+	return a->R == b->R && a->G == b->G && a->B == b->B && a->A == b->A;
+}
+
+DECODER_FN(Qoi){ // {{{
+	uint8_t *src, *end, op;
+	uint32_t width, height;
+	size_t i, count;
+	int run, vg;
+	Pixel index[64], px, *dst;
+
+	if(input->length < QOI_HEADER_SIZE + QOI_PADDING_SIZE)
+		return FAIL;
+
+	src = input->data;
+	if(src[0] != 'q' || src[1] != 'o' || src[2] != 'i' || src[3] != 'f')
+		return FAIL;
+
+	width = QOI_U32(src + 4);
+	height = QOI_U32(src + 8);
+	if(width == 0 || height == 0 || (src[12] != 3 && src[12] != 4))
+		return FAIL;
+
+	if(Image::checkSize(width, height, options) != SUCCESS)
+		return FAIL;
+
+	if(output->Malloc(width, height) != SUCCESS)
+		return FAIL;
+
+	memset(index, 0x00, sizeof(index));
+	px.R = px.G = px.B = 0;
+	px.A = 0xff;
+
+	src += QOI_HEADER_SIZE;
+	end = input->data + input->length - QOI_PADDING_SIZE;
+	dst = output->data[0];
+	count = (size_t) width * height;
+	run = 0;
+
+	for(i = 0; i < count; i++){
+		if(run > 0){
+			run--;
+		}else{
+			// Every chunk is at most 5 bytes and followed by the padding
+			if(src >= end){
+				output->Free();
+				return FAIL;
+			}
+
+			op = *src++;
+			if(op == QOI_OP_RGB){
+				px.R = src[0];
+				px.G = src[1];
+				px.B = src[2];
+				src += 3;
+			}else if(op == QOI_OP_RGBA){
+				px.R = src[0];
+				px.G = src[1];
+				px.B = src[2];
+				px.A = src[3];
+				src += 4;
+			}else{
+				switch(op & QOI_MASK_2){
+					case QOI_OP_INDEX:
+						px = index[op];
+						break;
+					case QOI_OP_DIFF:
+						px.R += ((op >> 4) & 0x03) - 2;
+						px.G += ((op >> 2) & 0x03) - 2;
+						px.B += (op & 0x03) - 2;
+						break;
+					case QOI_OP_LUMA:
+						vg = (op & 0x3f) - 32;
+						px.R += vg - 8 + ((*src >> 4) & 0x0f);
+						px.G += vg;
+						px.B += vg - 8 + (*src & 0x0f);
+						src++;
+						break;
+					case QOI_OP_RUN:
+						run = op & 0x3f;
+						break;
+				}
+			}
+			index[QOI_HASH(px)] = px;
+		}
+		dst[i] = px;
+	}
+
+	if(input->data[12] == 3){
+		output->type = SOLID;
+	}else{
+		output->DetectTransparent();
+	}
+	return SUCCESS;
+} // }}}
+
+ENCODER_FN(Qoi){ // {{{
+	uint8_t header[QOI_HEADER_SIZE], *line, *dst;
+	size_t x, y, width, height;
+	int run, h;
+	signed char vr, vg, vb, vg_r, vg_b;
+	Pixel index[64], prev, *px;
+	ImageState ret;
+
+	width = input->width;
+	height = input->height;
+	if(width == 0 || height == 0)
+		return FAIL;
+
+	header[0] = 'q';
+	header[1] = 'o';
+	header[2] = 'i';
+	header[3] = 'f';
+	QOI_SET32(header + 4, width);
+	QOI_SET32(header + 8, height);
+	header[12] = input->type == SOLID ? 3 : 4;
+	header[13] = 0; // sRGB with linear alpha
+
+	// Worst case is a 5 byte chunk per pixel, plus a pending run
+	if((line = (uint8_t *) malloc(width * 5 + 1)) == NULL)
+		return FAIL;
+
+	output->Estimate(QOI_HEADER_SIZE + width * height * 2 + QOI_PADDING_SIZE);
+	ret = output->Write(header, QOI_HEADER_SIZE);
+
+	memset(index, 0x00, sizeof(index));
+	prev.R = prev.G = prev.B = 0;
+	prev.A = 0xff;
+	run = 0;
+
+	for(y = 0; y < height && ret == SUCCESS; y++){
+		px = input->data[y];
+		dst = line;
+		for(x = 0; x < width; x++, px++){
+			if(qoi_equal(px, &prev)){
+				if(++run == 62){
+					*dst++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+
+			if(run > 0){
+				*dst++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			h = QOI_HASH(*px);
+			if(qoi_equal(&index[h], px)){
+				*dst++ = QOI_OP_INDEX | h;
+			}else{
+				index[h] = *px;
+				if(px->A == prev.A){
+					vr = px->R - prev.R;
+					vg = px->G - prev.G;
+					vb = px->B - prev.B;
+					vg_r = vr - vg;
+					vg_b = vb - vg;
+
+					if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2){
+						*dst++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+					}else if(vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8){
+						*dst++ = QOI_OP_LUMA | (vg + 32);
+						*dst++ = (vg_r + 8) << 4 | (vg_b + 8);
+					}else{
+						*dst++ = QOI_OP_RGB;
+						*dst++ = px->R;
+						*dst++ = px->G;
+						*dst++ = px->B;
+					}
+				}else{
+					*dst++ = QOI_OP_RGBA;
+					*dst++ = px->R;
+					*dst++ = px->G;
+					*dst++ = px->B;
+					*dst++ = px->A;
+				}
+			}
+			prev = *px;
+		}
+
+		// Runs carry over to the next row, flush the last one at the end
+		if(y == height - 1 && run > 0){
+			*dst++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+		ret = output->Write(line, dst - line);
+	}
+
+	if(ret == SUCCESS)
+		ret = output->Write(QoiPadding, QOI_PADDING_SIZE);
+
+	free(line);
+	return ret;
+} // }}}
+
+#endif
+
+// vim600: sw=4 ts=4 fdm=marker syn=cpp
@@ -33,99 +33,213 @@
 #ifdef HAVE_RAW
 
 #include <stdlib.h>
+#include <string.h>
 
 #define RAW_HEADER_SIZE 12
 
+// "RAWX" header: width, height, stride in bytes and channel order
+#define RAW_EXTENDED_HEADER_SIZE 20
+
+#define RAW_U32(p) ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16 | (uint32_t) (p)[2] << 8 | (uint32_t) (p)[3])
+#define RAW_SET32(p, v) do{ (p)[0] = ((v) >> 24) & 0xff; (p)[1] = ((v) >> 16) & 0xff; (p)[2] = ((v) >> 8) & 0xff; (p)[3] = (v) & 0xff; }while(0)
+
+typedef enum {
+	RAW_RGBA = 0,
+	RAW_BGRA,
+	RAW_ARGB,
+	RAW_ABGR,
+	RAW_ORDER_COUNT,
+} RawOrder;
+
+static const char *RawOrderNames[RAW_ORDER_COUNT] = { "RGBA", "BGRA", "ARGB", "ABGR" };
+
+// Byte offsets of R, G, B and A for each order
+static const uint8_t RawOrderOffsets[RAW_ORDER_COUNT][4] = {
+	{ 0, 1, 2, 3 },
+	{ 2, 1, 0, 3 },
+	{ 1, 2, 3, 0 },
+	{ 3, 2, 1, 0 },
+};
+
+typedef struct {
+	char R;
+	char A;
+	char W;
+	char _;
+	uint8_t order; // RawOrder
+	uint8_t align; // row alignment in bytes, 0 for packed rows
+} raw_compress_config;
+
+raw_compress_config default_raw_compress_config = {
+	'R','A','W',' ',
+	RAW_RGBA,
+	0,
+};
+
+raw_compress_config *get_raw_compress_config(ImageConfig *config){ // {{{
+	if(config == NULL || config->data == NULL
+	|| config->length != sizeof(raw_compress_config)
+	|| config->data[0] != default_raw_compress_config.R
+	|| config->data[1] != default_raw_compress_config.A
+	|| config->data[2] != default_raw_compress_config.W
+	|| config->data[3] != default_raw_compress_config._)
+		return &default_raw_compress_config;
+
+	return (raw_compress_config *) config->data;
+} // }}}
+
+void raw_row_swizzle(const uint8_t *src, Pixel *dst, size_t width, const uint8_t *offsets){ // {{{
+	size_t x;
+
+	for(x = 0; x < width; x++, src += 4){
+		dst[x].R = src[offsets[0]];
+		dst[x].G = src[offsets[1]];
+		dst[x].B = src[offsets[2]];
+		dst[x].A = src[offsets[3]];
+	}
+} // }}}
+
 DECODER_FN(Raw){ // {{{
-	uint32_t  width, height, x, y;
-	Pixel *sp, *dp;
+	uint32_t width, height, y;
+	size_t header, stride, size, cx, cy, cw, ch;
+	int order;
+	uint8_t *src;
 
 	if(input->length < RAW_HEADER_SIZE)
 		return FAIL;
 
 	if(	input->data[0] != 'R' ||
 			input->data[1] != 'A' ||
-			input->data[2] != 'W' ||
-			input->data[3] != '\n' )
+			input->data[2] != 'W')
 		return FAIL;
 
-	width = input->data[4] << 24
-		| input->data[5] << 16
-		| input->data[6] << 8
-		| input->data[7] << 0;
+	width = RAW_U32(input->data + 4);
+	height = RAW_U32(input->data + 8);
+	size = (size_t) width * sizeof(Pixel);
+
+	if(input->data[3] == '\n'){
+		header = RAW_HEADER_SIZE;
+		stride = size;
+		order = RAW_RGBA;
+	}else if(input->data[3] == 'X' && input->length >= RAW_EXTENDED_HEADER_SIZE){
+		header = RAW_EXTENDED_HEADER_SIZE;
+		stride = RAW_U32(input->data + 12);
+		for(order = 0; order < RAW_ORDER_COUNT; order++){
+			if(memcmp(input->data + 16, RawOrderNames[order], 4) == 0) break;
+		}
+		if(order == RAW_ORDER_COUNT || stride < size)
+			return FAIL;
+	}else{
+		return FAIL;
+	}
 
-	height = input->data[8] << 24
-		| input->data[9] << 16
-		| input->data[10] << 8
-		| input->data[11] << 0;
+	// The last row doesn't need its padding
+	if(width == 0 || height == 0 || (input->length - header) < size
+	|| (input->length - header - size) / stride + 1 < height)
+		return FAIL;
 
-	if(input->length != RAW_HEADER_SIZE + sizeof(Pixel) * width * height)
+	if(Image::checkSize(width, height, options) != SUCCESS)
 		return FAIL;
 
+	// Rows are random access, a region is copied straight out of the input
+	src = input->data + header;
+	if(options != NULL && options->Crop(width, height, &cx, &cy, &cw, &ch)){
+		src += cy * stride + cx * sizeof(Pixel);
+		width = cw;
+		height = ch;
+		size = cw * sizeof(Pixel);
+		options->cropped = true;
+	}
+
 	if(output->Malloc(width, height) != SUCCESS)
 		return FAIL;
 
-	sp = (Pixel *) (input->data + RAW_HEADER_SIZE);
-
-	for(y = 0; y < height; y++){
-		for(x = 0; x < width; x++){
-			dp = &(output->data[y][x]);
-			dp->R = sp->R;
-			dp->G = sp->G;
-			dp->B = sp->B;
-			dp->A = sp->A;
-			sp++;
-		}
+	if(order == RAW_RGBA && stride == size){
+		// Same layout as the pixel array, one copy for the whole image
+		memcpy(output->data[0], src, size * height);
+	}else if(order == RAW_RGBA){
+		for(y = 0; y < height; y++, src += stride)
+			memcpy(output->data[y], src, size);
+	}else{
+		for(y = 0; y < height; y++, src += stride)
+			raw_row_swizzle(src, output->data[y], width, RawOrderOffsets[order]);
 	}
-	output->type = SOLID;
+
+	output->DetectTransparent();
 	return SUCCESS;
 } // }}}
 
 ENCODER_FN(Raw){ // {{{
-	uint32_t width, height, x, y;
-	size_t length;
-	Pixel *sp, *dp;
-	uint8_t *data;
+	uint32_t width, height, y;
+	size_t size, stride, header_size, x;
+	uint8_t header[RAW_EXTENDED_HEADER_SIZE], *line, *dst;
+	const uint8_t *offsets;
+	raw_compress_config *conf;
+	bool extended;
+	Pixel *pixel;
+	ImageState ret;
 
 	width = input->width;
 	height = input->height;
-	length = RAW_HEADER_SIZE + width * height * 4;
-	data = (uint8_t*) malloc(length);
-
-	output->data = data;
-	output->length = output->position = length;
-
-	if(!data) return FAIL;
-
-	data[0] = 'R';
-	data[1] = 'A';
-	data[2] = 'W';
-	data[3] = '\n';
-
-	data[4]  = (width >> 24)  & 0xff;
-	data[5]  = (width >> 16)  & 0xff;
-	data[6]  = (width >> 8)   & 0xff;
-	data[7]  = (width >> 0)   & 0xff;
-
-	data[8]  = (height >> 24) & 0xff;
-	data[9]  = (height >> 16) & 0xff;
-	data[10] = (height >> 8)  & 0xff;
-	data[11] = (height >> 0)  & 0xff;
-
-	dp = (Pixel *)(data + RAW_HEADER_SIZE);
-
-	for(y = 0; y < height; y++){
-		for(x = 0; x < width; x++){
-			sp = &(input->data[y][x]);
-			dp->R = sp->R;
-			dp->G = sp->G;
-			dp->B = sp->B;
-			dp->A = sp->A;
-			dp++;
+	size = width * sizeof(Pixel);
+
+	conf = get_raw_compress_config(config);
+	if(conf->order >= RAW_ORDER_COUNT)
+		return FAIL;
+
+	stride = size;
+	if(conf->align > 1)
+		stride = (size + conf->align - 1) / conf->align * conf->align;
+
+	// Plain RGBA with packed rows keeps the original header
+	extended = conf->order != RAW_RGBA || stride != size;
+	header_size = extended ? RAW_EXTENDED_HEADER_SIZE : RAW_HEADER_SIZE;
+
+	header[0] = 'R';
+	header[1] = 'A';
+	header[2] = 'W';
+	header[3] = extended ? 'X' : '\n';
+	RAW_SET32(header + 4, width);
+	RAW_SET32(header + 8, height);
+	if(extended){
+		RAW_SET32(header + 12, stride);
+		memcpy(header + 16, RawOrderNames[conf->order], 4);
+	}
+
+	output->Estimate(header_size + stride * height);
+	if(output->Write(header, header_size) != SUCCESS)
+		return FAIL;
+
+	if(!extended){
+		for(y = 0; y < height; y++){
+			if(output->Write(input->data[y], size) != SUCCESS)
+				return FAIL;
 		}
+		return SUCCESS;
 	}
 
-	return SUCCESS;
+	if((line = (uint8_t *) calloc(1, stride)) == NULL)
+		return FAIL;
+
+	ret = SUCCESS;
+	offsets = RawOrderOffsets[conf->order];
+	for(y = 0; y < height && ret == SUCCESS; y++){
+		pixel = input->data[y];
+		if(conf->order == RAW_RGBA){
+			memcpy(line, pixel, size);
+		}else{
+			for(x = 0, dst = line; x < width; x++, dst += 4){
+				dst[offsets[0]] = pixel[x].R;
+				dst[offsets[1]] = pixel[x].G;
+				dst[offsets[2]] = pixel[x].B;
+				dst[offsets[3]] = pixel[x].A;
+			}
+		}
+		ret = output->Write(line, stride);
+	}
+
+	free(line);
+	return ret;
 } // }}}
 
 #endif
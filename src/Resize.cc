@@ -29,7 +29,10 @@
 #include <stdio.h>
 #include <vector>
 #include <string.h>
+#include <math.h>
+#include <stdint.h>
 #include "Image.h"
+#include "Resize.h"
 #include "resampler.h"
 
 
@@ -38,111 +41,275 @@ Pixel *get_subpixel( PixelArray *pixels, int x, int y ) {
     return &(pixels->data[ y ][ x ]);
 }
 
-void resample(PixelArray *src, PixelArray *dst, const char *filter);
-
-void resize(PixelArray *src, PixelArray *dst, const char *filter = NULL) {
+void resize(PixelArray *src, PixelArray *dst, const char *filter, bool fast) {
+    void (*engine)(PixelArray *, PixelArray *, const char *) = fast ? resample_fixed : resample;
 
     if ( filter == NULL ) {
         float scale = dst->width / src->width;
 
         if ( scale >= 0.25 ) {
-            resample( src, dst, "bicubic" );
+            engine( src, dst, "bicubic" );
         } else {
-            resample( src, dst, "box");
-            resample( dst, dst, "bicubic");
+            engine( src, dst, "box");
+            engine( dst, dst, "bicubic");
         }
 
     } else {
-        resample( src, dst, filter );
+        engine( src, dst, filter );
     }
 }
 
-void resample(PixelArray *src, PixelArray *dst, const char *pFilter) {
-    int src_width = src->width, src_height = src->height,
-        dst_width = dst->width, dst_height = dst->height;
+// Fixed point weights, FIXED_BITS of fraction, and FIXED_EXTRA_BITS kept below the 8 bit samples between the passes
+#define FIXED_BITS 14
+#define FIXED_EXTRA_BITS 6
+#define FIXED_ROUND_X (1 << (FIXED_BITS - FIXED_EXTRA_BITS - 1))
+#define FIXED_ROUND_Y (1 << (FIXED_BITS + FIXED_EXTRA_BITS - 1))
 
-    // Filter scale - values < 1.0 cause aliasing, but create sharper looking mips.
-    const float filter_scale = 1.0f;//.75f;
+#if !defined(RESAMPLER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FIXED_SSE2 1
+#include <emmintrin.h>
+#endif
 
-    // 0 - R
-    // 1 - G
-    // 2 - B
-    // 3 - A
-    std::vector<float> samples[4];
-    Resampler* resamplers[4];
-
-    // Now create a Resampler instance for each component to process. The first instance will create new contributor tables, which are shared by the resamplers
-    // used for the other components (a memory and slight cache efficiency optimization).
-    resamplers[0] = new Resampler(src_width, src_height, dst_width, dst_height, Resampler::BOUNDARY_CLAMP, 0.0f, 1.0f, pFilter, NULL, NULL, filter_scale, filter_scale);
-    samples[0].resize(src_width);
-    for (int i = 1; i < 4; i++)
-    {
-      resamplers[i] = new Resampler(src_width, src_height, dst_width, dst_height, Resampler::BOUNDARY_CLAMP, 0.0f, 1.0f, pFilter, resamplers[0]->get_clist_x(), resamplers[0]->get_clist_y(), filter_scale, filter_scale);
-      samples[i].resize(src_width);
+typedef struct {
+    std::vector<int> start;          // offset of each contributor list in pixel and weight
+    std::vector<int> count;
+    std::vector<int> first;          // first pixel when the list covers consecutive pixels, -1 otherwise
+    std::vector<int> pixel;
+    std::vector<int16_t> weight;
+} FixedList;
+
+// Quantize the float contributors, the weights of a list still add up to exactly 1 << FIXED_BITS
+static void fixed_list(FixedList *list, const Resampler::Contrib_List *clist, int n) {
+    int i, j, sum, max, w;
+
+    list->start.resize(n);
+    list->count.resize(n);
+    list->first.resize(n);
+    for (i = 0; i < n; i++) {
+        list->start[i] = list->pixel.size();
+        list->count[i] = clist[i].n;
+        list->first[i] = clist[i].n > 0 ? clist[i].p[0].pixel : -1;
+        sum = 0;
+        max = list->start[i];
+        for (j = 0; j < clist[i].n; j++) {
+            w = (int) floorf(clist[i].p[j].weight * (1 << FIXED_BITS) + 0.5f);
+            if (w < INT16_MIN) w = INT16_MIN; else if (w > INT16_MAX) w = INT16_MAX;
+            if (j == 0 || w > list->weight[max]) max = list->pixel.size();
+            if (clist[i].p[j].pixel != list->first[i] + j) list->first[i] = -1;
+            list->pixel.push_back(clist[i].p[j].pixel);
+            list->weight.push_back(w);
+            sum += w;
+        }
+        if (clist[i].n > 0) list->weight[max] += (1 << FIXED_BITS) - sum;
     }
+}
 
-    for (int src_y = 0; src_y < src_height; src_y++)
-    {
-        for (int x = 0; x < src_width; x++)
-        {
-            samples[0][x] = get_subpixel( src, x, src_y )->R * (1.0f/255.0f);
-            samples[1][x] = get_subpixel( src, x, src_y )->G * (1.0f/255.0f);
-            samples[2][x] = get_subpixel( src, x, src_y )->B * (1.0f/255.0f);
-            samples[3][x] = get_subpixel( src, x, src_y )->A * (1.0f/255.0f);
+static inline int16_t fixed_clamp16(int v) {
+    // Overshoot of the negative lobes stays well inside 16 bits
+    return v < INT16_MIN ? INT16_MIN : v > INT16_MAX ? INT16_MAX : v;
+}
+
+static inline void fixed_pixel_x(const Pixel *src, int16_t *dst, const int *pixel, const int16_t *weight, int n) {
+    int j, r, g, b, a;
+
+    r = g = b = a = FIXED_ROUND_X;
+    for (j = 0; j < n; j++) {
+        const Pixel *p = &src[pixel[j]];
+        r += p->R * weight[j];
+        g += p->G * weight[j];
+        b += p->B * weight[j];
+        a += p->A * weight[j];
+    }
+    dst[0] = fixed_clamp16(r >> (FIXED_BITS - FIXED_EXTRA_BITS));
+    dst[1] = fixed_clamp16(g >> (FIXED_BITS - FIXED_EXTRA_BITS));
+    dst[2] = fixed_clamp16(b >> (FIXED_BITS - FIXED_EXTRA_BITS));
+    dst[3] = fixed_clamp16(a >> (FIXED_BITS - FIXED_EXTRA_BITS));
+}
+
+#if FIXED_SSE2
+static inline __m128i fixed_weight_pair(int w0, int w1) {
+    return _mm_set1_epi32((int) ((uint32_t) (uint16_t) w1 << 16 | (uint16_t) w0));
+}
+
+// Two neighbouring pixels are interleaved as R0 R1 G0 G1 B0 B1 A0 A1, so pmaddwd gives the four channel sums
+static void fixed_row_x(const Pixel *src, int16_t *dst, const FixedList *list, int width) {
+    int x, j, n, p;
+    const int16_t *weight;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum, pixels;
+
+    for (x = 0; x < width; x++, dst += 4) {
+        n = list->count[x];
+        weight = &list->weight[list->start[x]];
+        if (list->first[x] < 0) {
+            fixed_pixel_x(src, dst, &list->pixel[list->start[x]], weight, n);
+            continue;
         }
 
-        for (int c = 0; c < 4; c++)
-        {
-            if (!resamplers[c]->put_line(&samples[c][0]))
-            {
-                // printf("Out of memory!\n");
-                return;
-            }
+        const uint8_t *s = (const uint8_t *) (src + list->first[x]);
+        sum = _mm_set1_epi32(FIXED_ROUND_X);
+        for (j = 0; j + 1 < n; j += 2, s += 8) {
+            pixels = _mm_loadl_epi64((const __m128i *) s);
+            pixels = _mm_unpacklo_epi8(_mm_unpacklo_epi8(pixels, _mm_srli_si128(pixels, 4)), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, fixed_weight_pair(weight[j], weight[j + 1])));
         }
+        if (j < n) {
+            memcpy(&p, s, 4);
+            pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p), zero), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, fixed_weight_pair(weight[j], 0)));
+        }
+        sum = _mm_srai_epi32(sum, FIXED_BITS - FIXED_EXTRA_BITS);
+        _mm_storel_epi64((__m128i *) dst, _mm_packs_epi32(sum, sum));
     }
+}
 
-    for (int dst_y = 0; dst_y < dst_height; dst_y++)
-    {
-        const float* rOutput_samples = resamplers[0]->get_line();
-        const float* gOutput_samples = resamplers[1]->get_line();
-        const float* bOutput_samples = resamplers[2]->get_line();
-        const float* aOutput_samples = resamplers[3]->get_line();
+// Eight samples at a time, two rows per pmaddwd, an odd row is paired with itself at weight 0
+static void fixed_row_y(int16_t **rows, const int16_t *weight, int n, int32_t *, uint8_t *dst, int width) {
+    int i, j, k, count;
+    __m128i lo, hi, a, b, w, out;
 
-        if (!rOutput_samples || !gOutput_samples || !bOutput_samples || !aOutput_samples)
-           break;
+    count = width * 4;
+    for (i = 0; i < count; i += 8) {
+        lo = hi = _mm_set1_epi32(FIXED_ROUND_Y);
+        for (j = 0; j < n; j += 2) {
+            k = j + 1 < n ? j + 1 : j;
+            w = fixed_weight_pair(weight[j], k > j ? weight[k] : 0);
+            if (i + 8 <= count) {
+                a = _mm_loadu_si128((const __m128i *) (rows[j] + i));
+                b = _mm_loadu_si128((const __m128i *) (rows[k] + i));
+            } else {
+                a = _mm_loadl_epi64((const __m128i *) (rows[j] + i));
+                b = _mm_loadl_epi64((const __m128i *) (rows[k] + i));
+            }
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        lo = _mm_srai_epi32(lo, FIXED_BITS + FIXED_EXTRA_BITS);
+        hi = _mm_srai_epi32(hi, FIXED_BITS + FIXED_EXTRA_BITS);
+        out = _mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128());
+        if (i + 8 <= count) {
+            _mm_storel_epi64((__m128i *) (dst + i), out);
+        } else {
+            k = _mm_cvtsi128_si32(out);
+            memcpy(dst + i, &k, 4);
+        }
+    }
+}
+#else
+static void fixed_row_x(const Pixel *src, int16_t *dst, const FixedList *list, int width) {
+    int x;
 
-        for (int x = 0; x < dst_width; x++)
-        {
+    for (x = 0; x < width; x++, dst += 4)
+        fixed_pixel_x(src, dst, &list->pixel[list->start[x]], &list->weight[list->start[x]], list->count[x]);
+}
 
-            //printf( "%d : %f - %f\n", x, samples[0][x], rOutput_samples[x] );
-            int r = (int)(255.0f * rOutput_samples[x] + .5f);
+// Row by row so the inner loop runs over contiguous samples
+static void fixed_row_y(int16_t **rows, const int16_t *weight, int n, int32_t *sum, uint8_t *dst, int width) {
+    int i, j, v, w;
+    const int16_t *row;
 
-            if (r < 0) r = 0; else if (r> 255) r = 255;
-            get_subpixel( dst, x, dst_y )->R = r;
+    for (i = 0; i < width * 4; i++)
+        sum[i] = FIXED_ROUND_Y;
 
-            int g = (int)(255.0f * gOutput_samples[x] + .5f);
+    for (j = 0; j < n; j++) {
+        row = rows[j];
+        w = weight[j];
+        for (i = 0; i < width * 4; i++)
+            sum[i] += row[i] * w;
+    }
 
-            if (g < 0) g = 0; else if (g> 255) g = 255;
-            get_subpixel( dst, x, dst_y )->G = g;
+    for (i = 0; i < width * 4; i++) {
+        v = sum[i] >> (FIXED_BITS + FIXED_EXTRA_BITS);
+        dst[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+}
+#endif
 
-            int b = (int)(255.0f * bOutput_samples[x] + .5f);
+// Same filters and contributors as resample(), but 8 bit samples, 16 bit weights and 32 bit sums.
+// Filtered source rows are kept in a ring as long as a destination row needs them
+void resample_fixed(PixelArray *src, PixelArray *dst, const char *pFilter) {
+    int src_width = src->width, src_height = src->height,
+        dst_width = dst->width, dst_height = dst->height;
+    int x, y, j, n, lo, hi, ring, next;
+    FixedList list_x, list_y;
 
-            if (b < 0) b = 0; else if (b> 255) b = 255;
-            get_subpixel( dst, x, dst_y )->B = b;
+    Resampler resampler(src_width, src_height, dst_width, dst_height, Resampler::BOUNDARY_CLAMP, 0.0f, 1.0f, pFilter);
+    if (resampler.status() != Resampler::STATUS_OKAY) {
+        resample(src, dst, pFilter);
+        return;
+    }
+    fixed_list(&list_x, resampler.get_clist_x(), dst_width);
+    fixed_list(&list_y, resampler.get_clist_y(), dst_height);
 
-            int a = (int)(255.0f * aOutput_samples[x] + .5f);
+    // Source rows of a list are within [lo, hi], both never go backwards
+    ring = 1;
+    for (y = 0; y < dst_height; y++) {
+        lo = src_height;
+        hi = 0;
+        for (j = 0; j < list_y.count[y]; j++) {
+            x = list_y.pixel[list_y.start[y] + j];
+            if (x < lo) lo = x;
+            if (x > hi) hi = x;
+        }
+        if (hi - lo + 1 > ring) ring = hi - lo + 1;
+    }
 
-            if (a < 0) a = 0; else if (a> 255) a = 255;
-            get_subpixel( dst, x, dst_y )->A = a;
+    std::vector<int16_t> buffer((size_t) ring * dst_width * 4);
+    std::vector<int16_t *> rows(list_y.pixel.size() ? list_y.pixel.size() : 1);
+    std::vector<int32_t> sum((size_t) dst_width * 4);
 
-            // printf( "(%d, %d, %d, %d), ", get_subpixel( dst, x, dst_y )->R, get_subpixel( dst, x, dst_y )->G, get_subpixel( dst, x, dst_y )->B, get_subpixel( dst, x, dst_y )->A );
+    next = 0;
+    for (y = 0; y < dst_height; y++) {
+        n = list_y.count[y];
+        hi = 0;
+        for (j = 0; j < n; j++) {
+            x = list_y.pixel[list_y.start[y] + j];
+            if (x > hi) hi = x;
         }
 
-        // printf("\n");
+        // Read source rows before the destination rows can overwrite them (box then bicubic works in place)
+        for (; next <= hi; next++)
+            fixed_row_x(src->data[next], &buffer[(size_t) (next % ring) * dst_width * 4], &list_x, dst_width);
+
+        for (j = 0; j < n; j++)
+            rows[j] = &buffer[(size_t) (list_y.pixel[list_y.start[y] + j] % ring) * dst_width * 4];
+        fixed_row_y(&rows[0], &list_y.weight[list_y.start[y]], n, &sum[0], (uint8_t *) dst->data[y], dst_width);
     }
+}
+
+void resample(PixelArray *src, PixelArray *dst, const char *pFilter) {
+    int src_width = src->width, src_height = src->height,
+        dst_width = dst->width, dst_height = dst->height;
 
-    delete resamplers[0];
-    delete resamplers[1];
-    delete resamplers[2];
-    delete resamplers[3];
+    // Filter scale - values < 1.0 cause aliasing, but create sharper looking mips.
+    const float filter_scale = 1.0f;//.75f;
+
+    // One resampler for the interleaved R, G, B and A samples, fed straight from the pixel rows
+    Resampler resampler(src_width, src_height, dst_width, dst_height, Resampler::BOUNDARY_CLAMP, 0.0f, 1.0f, pFilter, NULL, NULL, filter_scale, filter_scale, 0.0f, 0.0f, 4);
+
+    int dst_y = 0;
+    for (int src_y = 0; src_y < src_height; src_y++)
+    {
+        if (!resampler.put_line((const unsigned char *) src->data[src_y]))
+        {
+            // printf("Out of memory!\n");
+            return;
+        }
+
+        // Take the rows that are ready, only the filter window stays buffered. A destination row comes out after
+        // every source row it needs was read, so resizing in place (box then bicubic) is safe
+        const float* output;
+        while ((output = resampler.get_line()) != NULL)
+        {
+            uint8_t *row = (uint8_t *) dst->data[dst_y++];
+
+            for (int x = 0; x < dst_width * 4; x++)
+            {
+                int v = (int)(255.0f * output[x] + .5f);
+
+                if (v < 0) v = 0; else if (v> 255) v = 255;
+                row[x] = v;
+            }
+        }
+    }
 }
\ No newline at end of file
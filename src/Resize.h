@@ -32,8 +32,10 @@
 
 
 
-void resize(PixelArray *src, PixelArray *dst, const char *filter = NULL);
+// fast uses resample_fixed instead of the floating point resample
+void resize(PixelArray *src, PixelArray *dst, const char *filter = NULL, bool fast = true);
 void resample(PixelArray *src, PixelArray *dst, const char *filter = NULL);
+void resample_fixed(PixelArray *src, PixelArray *dst, const char *filter = NULL);
 Pixel *get_subpixel( PixelArray *pixels, int x, int y );
 
 #endif
\ No newline at end of file
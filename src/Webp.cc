@@ -39,67 +39,350 @@
 #include <stdlib.h>
 
 DECODER_FN(Webp){ // {{{
-    int width;
-    int height;
-    int line;
-    int size;
-    uint8_t *rgba;
-
-    rgba = WebPDecodeRGBA(input->data, input->length, &width, &height);
-    
-    if (rgba == NULL){
+    WebPDecoderConfig config;
+    WebPDecBuffer *buffer;
+    size_t x, y, width, height;
+
+    if(!WebPInitDecoderConfig(&config)){
+        return FAIL;
+    }
+
+    if(WebPGetFeatures(input->data, input->length, &config.input) != VP8_STATUS_OK){
+        return FAIL;
+    }
+
+    width = config.input.width;
+    height = config.input.height;
+    if(Image::checkSize(width, height, options) != SUCCESS){
         return FAIL;
     }
 
+    if(options != NULL){
+        // libwebp snaps odd crop offsets of lossy images, leave those to the generic crop
+        if(options->Crop(width, height, &x, &y, &width, &height)){
+            if((x | y) & 1){
+                width = config.input.width;
+                height = config.input.height;
+                goto DECODE;
+            }
+            config.options.use_cropping = 1;
+            config.options.crop_left = x;
+            config.options.crop_top = y;
+            config.options.crop_width = width;
+            config.options.crop_height = height;
+        }
+        if(options->Scale(width, height, &width, &height)){
+            config.options.use_scaling = 1;
+            config.options.scaled_width = width;
+            config.options.scaled_height = height;
+        }
+        options->handled = true;
+    }
+
+DECODE:
     if(output->Malloc(width, height) != SUCCESS){
-        WebPFree(rgba);
         return FAIL;
     }
 
-    size = width * sizeof(Pixel);
-    for(line = 0; line < height; line++){
-        memcpy(output->data[line], &(rgba[size * line]), size);
+    // Decode straight into the pixel rows
+    buffer = &config.output;
+    buffer->colorspace = MODE_RGBA;
+    buffer->is_external_memory = 1;
+    buffer->u.RGBA.rgba = (uint8_t *) output->data[0];
+    buffer->u.RGBA.stride = width * sizeof(Pixel);
+    buffer->u.RGBA.size = width * height * sizeof(Pixel);
+
+    if(WebPDecode(input->data, input->length, &config) != VP8_STATUS_OK){
+        WebPFreeDecBuffer(buffer);
+        output->Free();
+        return FAIL;
+    }
+    WebPFreeDecBuffer(buffer);
+
+    if(config.input.has_alpha){
+        output->DetectTransparent();
+    }else{
+        output->type = SOLID;
+    }
+    return SUCCESS;
+} // }}}
+
+#define WEBP_STREAM_HEADER_LIMIT 65536
+
+typedef struct {
+    WebPIDecoder *idec;
+    WebPDecBuffer buffer;
+    WebPBitstreamFeatures features;
+    uint8_t *header;  // input kept until the features are known
+    size_t length;
+} webp_stream_context;
+
+ImageState webp_stream_open(ImageStream *stream, ImageData *input){ // {{{
+    webp_stream_context *ctx;
+
+    if(input->length < 12) return FAIL;
+    if(memcmp(input->data, "RIFF", 4) != 0 || memcmp(input->data + 8, "WEBP", 4) != 0) return FAIL;
+    if((ctx = (webp_stream_context *) malloc(sizeof(webp_stream_context))) == NULL) return FAIL;
+
+    ctx->idec = NULL;
+    ctx->header = NULL;
+    ctx->length = 0;
+    stream->context = ctx;
+    return SUCCESS;
+} // }}}
+
+// Set up a decoder writing into the pixel rows once the size is known
+ImageState webp_stream_start(ImageStream *stream, webp_stream_context *ctx){ // {{{
+    PixelArray *output;
+    WebPDecBuffer *buffer;
+
+    output = stream->output;
+    if(ctx->features.has_animation) return FAIL;
+    if(Image::checkSize(ctx->features.width, ctx->features.height, stream->options) != SUCCESS) return FAIL;
+    if(output->Malloc(ctx->features.width, ctx->features.height) != SUCCESS) return FAIL;
+
+    buffer = &(ctx->buffer);
+    if(!WebPInitDecBuffer(buffer)) return FAIL;
+    buffer->colorspace = MODE_RGBA;
+    buffer->is_external_memory = 1;
+    buffer->u.RGBA.rgba = (uint8_t *) output->data[0];
+    buffer->u.RGBA.stride = output->width * sizeof(Pixel);
+    buffer->u.RGBA.size = output->width * output->height * sizeof(Pixel);
+
+    if((ctx->idec = WebPINewDecoder(buffer)) == NULL) return FAIL;
+    return SUCCESS;
+} // }}}
+
+ImageState webp_stream_append(ImageStream *stream, webp_stream_context *ctx, const uint8_t *data, size_t length){ // {{{
+    VP8StatusCode status;
+    int rows;
+
+    status = WebPIAppend(ctx->idec, data, length);
+    if(status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED) return FAIL;
+
+    if(WebPIDecGetRGB(ctx->idec, &rows, NULL, NULL, NULL) != NULL && rows > 0)
+        stream->rows = rows;
+
+    if(status == VP8_STATUS_OK){
+        stream->rows = stream->output->height;
+        if(ctx->features.has_alpha){
+            stream->output->DetectTransparent();
+        }else{
+            stream->output->type = SOLID;
+        }
+        stream->done = true;
     }
-    WebPFree(rgba);
-    output->DetectTransparent();
     return SUCCESS;
 } // }}}
 
+ImageState webp_stream_write(ImageStream *stream, ImageData *input){ // {{{
+    webp_stream_context *ctx;
+    VP8StatusCode status;
+    uint8_t *header;
+    ImageState ret;
+
+    ctx = (webp_stream_context *) stream->context;
+
+    if(ctx->idec != NULL)
+        return webp_stream_append(stream, ctx, input->data, input->length);
+
+    if(ctx->length + input->length > WEBP_STREAM_HEADER_LIMIT) return FAIL;
+    if((header = (uint8_t *) realloc(ctx->header, ctx->length + input->length)) == NULL) return FAIL;
+    memcpy(header + ctx->length, input->data, input->length);
+    ctx->header = header;
+    ctx->length += input->length;
+
+    status = WebPGetFeatures(ctx->header, ctx->length, &(ctx->features));
+    if(status == VP8_STATUS_NOT_ENOUGH_DATA) return SUCCESS;
+    if(status != VP8_STATUS_OK) return FAIL;
+
+    if(webp_stream_start(stream, ctx) != SUCCESS) return FAIL;
+
+    ret = webp_stream_append(stream, ctx, ctx->header, ctx->length);
+    free(ctx->header);
+    ctx->header = NULL;
+    ctx->length = 0;
+    return ret;
+} // }}}
+
+void webp_stream_close(ImageStream *stream){ // {{{
+    webp_stream_context *ctx;
+
+    ctx = (webp_stream_context *) stream->context;
+    if(ctx->idec != NULL){
+        WebPIDelete(ctx->idec);
+        WebPFreeDecBuffer(&(ctx->buffer));
+    }
+    free(ctx->header);
+    free(ctx);
+    stream->context = NULL;
+} // }}}
+
+ImageStreamDecoder STREAM_DECODER(Webp) = {
+    webp_stream_open,
+    webp_stream_write,
+    webp_stream_close,
+};
+
+typedef struct {
+    char W;
+    char E;
+    char B;
+    char P;
+    uint8_t quality;       // 0-100
+    uint8_t method;        // 0 (fast) - 6 (small)
+    uint8_t alpha_quality; // 0-100
+    uint8_t near_lossless; // 0-100, 100 is off
+    uint8_t lossless;
+    uint8_t threads;
+    uint8_t max_bytes[4];  // little endian, 0 for no limit
+} webp_compress_config;
+
+#define WEBP_CONFIG_DEFAULT 0xFF
+
+#define WEBP_U32(p) ((uint32_t) (p)[0] | (uint32_t) (p)[1] << 8 | (uint32_t) (p)[2] << 16 | (uint32_t) (p)[3] << 24)
+
+// Passes of libwebp's own size search, and how often to retry when it overshoots
+#define WEBP_SIZE_PASSES 6
+#define WEBP_SIZE_RETRIES 3
+
+webp_compress_config default_webp_compress_config = {
+    'W','E','B','P',
+    WEBP_CONFIG_DEFAULT,
+    WEBP_CONFIG_DEFAULT,
+    WEBP_CONFIG_DEFAULT,
+    WEBP_CONFIG_DEFAULT,
+    1,
+    0,
+    {0, 0, 0, 0},
+};
+
+webp_compress_config *get_webp_compress_config(ImageConfig *config){ // {{{
+    if(config == NULL || config->data == NULL
+    || config->length != sizeof(webp_compress_config)
+    || config->data[0] != default_webp_compress_config.W
+    || config->data[1] != default_webp_compress_config.E
+    || config->data[2] != default_webp_compress_config.B
+    || config->data[3] != default_webp_compress_config.P)
+        return &default_webp_compress_config;
+
+    return (webp_compress_config *) config->data;
+} // }}}
+
+ImageState set_webp_compress_config(WebPConfig *config, webp_compress_config *conf){ // {{{
+    float quality;
+
+    quality = conf->quality == WEBP_CONFIG_DEFAULT ? 75 : (conf->quality > 100 ? 100 : conf->quality);
+    if(!WebPConfigPreset(config, WEBP_PRESET_DEFAULT, quality)) return FAIL;
+
+    if(conf->lossless){
+        // Quality drives the compression effort in lossless mode
+        if(!WebPConfigLosslessPreset(config, conf->method == WEBP_CONFIG_DEFAULT ? 6 : (conf->method > 9 ? 9 : conf->method))) return FAIL;
+        if(conf->quality != WEBP_CONFIG_DEFAULT) config->quality = quality;
+    }else if(conf->method != WEBP_CONFIG_DEFAULT){
+        config->method = conf->method > 6 ? 6 : conf->method;
+    }
+
+    if(conf->alpha_quality != WEBP_CONFIG_DEFAULT)
+        config->alpha_quality = conf->alpha_quality > 100 ? 100 : conf->alpha_quality;
+
+    if(conf->near_lossless != WEBP_CONFIG_DEFAULT && conf->near_lossless < 100){
+        config->lossless = 1;
+        config->near_lossless = conf->near_lossless;
+    }
+
+    config->thread_level = conf->threads ? 1 : 0;
+
+    // libwebp searches the quality for a target size, lossy only
+    if(WEBP_U32(conf->max_bytes) > 0 && !config->lossless){
+        config->target_size = WEBP_U32(conf->max_bytes);
+        config->pass = WEBP_SIZE_PASSES;
+    }
+
+    return WebPValidateConfig(config) ? SUCCESS : FAIL;
+} // }}}
+
+int webp_image_writer(const uint8_t *data, size_t size, const WebPPicture *picture){ // {{{
+    ImageData *output;
+
+    output = (ImageData *) picture->custom_ptr;
+    return output->Write(data, size) == SUCCESS;
+} // }}}
+
 ENCODER_FN(Webp){ // {{{
-    uint8_t *rgba;
-    uint8_t *dist;
-    int width;
-    int height;
-    int line;
-    int line_size;
-    size_t size;
-    uint8_t *buffer;
-
-    width = input->width;
-    height = input->height;
-    line_size = width * sizeof(Pixel);
-    rgba = (uint8_t *) malloc(height * line_size);
-
-    if(rgba == NULL){
+    WebPConfig webp_config;
+    WebPPicture picture;
+    webp_compress_config *conf;
+    size_t x, y, max_bytes;
+    uint32_t *argb;
+    Pixel *pixel;
+    ImageData trial;
+    int i;
+    bool over;
+    ImageState ret;
+
+    if(!WebPConfigInit(&webp_config) || !WebPPictureInit(&picture)){
         return FAIL;
     }
 
-    dist = rgba;
-    for(line = 0;line < height; line++){
-        memcpy(dist, input->data[line], line_size);
-        dist += line_size;
+    conf = get_webp_compress_config(config);
+    if(set_webp_compress_config(&webp_config, conf) != SUCCESS){
+        return FAIL;
     }
 
-    size = WebPEncodeLosslessRGBA(rgba, width, height, line_size, &buffer);
-    if(size != 0){
-        output->data = (uint8_t *) malloc(size);
-        output->length = size;
-        output->position = size;
-        memcpy(output->data, buffer, size);
+    picture.use_argb = 1;
+    picture.width = input->width;
+    picture.height = input->height;
+    if(!WebPPictureAlloc(&picture)){
+        return FAIL;
     }
-    WebPFree(buffer);
 
-    return SUCCESS;
+    // Fill the picture straight from the rows, no intermediate RGBA copy
+    for(y = 0; y < input->height; y++){
+        pixel = input->data[y];
+        argb = picture.argb + y * picture.argb_stride;
+        for(x = 0; x < input->width; x++, pixel++){
+            argb[x] = (uint32_t) pixel->A << 24 | (uint32_t) pixel->R << 16 | (uint32_t) pixel->G << 8 | pixel->B;
+        }
+    }
+
+    picture.writer = webp_image_writer;
+    max_bytes = WEBP_U32(conf->max_bytes);
+    if(max_bytes == 0){
+        output->Estimate((size_t) input->width * input->height / (webp_config.lossless ? 2 : 8));
+        picture.custom_ptr = (void *) output;
+        ret = WebPEncode(&webp_config, &picture) ? SUCCESS : FAIL;
+        WebPPictureFree(&picture);
+        return ret;
+    }
+
+    // The size search is approximate, aim lower while it overshoots
+    memset(&trial, 0x00, sizeof(ImageData));
+    picture.custom_ptr = (void *) &trial;
+    ret = FAIL;
+    over = false;
+    for(i = 0; i < WEBP_SIZE_RETRIES; i++){
+        trial.position = 0;
+        if(!WebPEncode(&webp_config, &picture)){
+            over = false;
+            break;
+        }
+        over = trial.position > max_bytes;
+        if(!over){
+            ret = output->Write(trial.data, trial.position);
+            break;
+        }
+        if(webp_config.lossless) break;
+        webp_config.target_size = (int) ((uint64_t) webp_config.target_size * max_bytes / trial.position * 15 / 16);
+        if(webp_config.target_size <= 0) break;
+    }
+    if(over)
+        Image::setError("Can't encode within maxBytes.");
+
+    free(trial.data);
+    WebPPictureFree(&picture);
+
+    return ret;
 } // }}}
 
 #endif
@@ -0,0 +1,122 @@
+/*
+ * images_codec.h
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013 ZhangYuanwei <zhangyuanwei1988@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL INTEL AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Codecs built outside of the addon, in a shared object loaded with
+ * images.loadCodec(file). This header is plain C and doesn't depend on
+ * node or V8, a codec library only needs to include it and export
+ *
+ *     int images_codec_init(images_register_codec reg, void *registry);
+ *
+ * which calls reg(registry, &codec) once for each format it provides.
+ * The library is never unloaded, so the codec structs and names must stay
+ * valid for the life of the process.
+ *
+ * Pixels are 8 bit RGBA, rows are contiguous and width * 4 bytes long.
+ */
+
+#ifndef __IMAGES_CODEC_H__
+#define __IMAGES_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped on any incompatible change to the structs below
+#define IMAGES_CODEC_ABI_VERSION 1
+
+#define IMAGES_CODEC_INIT "images_codec_init"
+
+#define IMAGES_FAIL 0
+#define IMAGES_OK 1
+
+// Services of the host, passed to every call
+typedef struct images_host {
+    // Allocate the decoded image, return the first row or NULL (size limit, out of memory)
+    uint8_t *(*alloc)(void *target, size_t width, size_t height);
+
+    // Append encoded bytes to the output
+    int (*write)(void *target, const void *data, size_t length);
+
+    // Report an error, message must stay valid (a string literal), return IMAGES_FAIL
+    int (*error)(const char *message);
+} images_host;
+
+typedef struct images_codec {
+    int abi_version; // IMAGES_CODEC_ABI_VERSION
+
+    // Lower case file extension without the dot, also used as images.TYPE_<NAME>
+    const char *name;
+
+    // Signature at magic_offset, checked before probe
+    const uint8_t *magic;
+    size_t magic_length;
+    size_t magic_offset;
+
+    // Return non-zero if data looks like this format, data may be truncated.
+    // Decoding needs at least one of magic or probe
+    int (*probe)(const uint8_t *data, size_t length);
+
+    // Decode the whole input, allocating the image with host->alloc
+    int (*decode)(const images_host *host, void *target, const uint8_t *data, size_t length);
+
+    // Encode width * height pixels, has_alpha is 0 if every pixel is opaque.
+    // Called from the thread pool by encodeMany, possibly several at once.
+    // config is the Buffer made by the JS configure hook, NULL if none
+    int (*encode)(const images_host *host, void *target, const uint8_t *rgba,
+            size_t width, size_t height, int has_alpha,
+            const uint8_t *config, size_t config_length);
+
+    // Optional incremental decoding, all three or none.
+    // stream_open gets the leading bytes and returns the decoder state, NULL if it's not this format.
+    // The same bytes are then passed to stream_write as the first chunk
+    void *(*stream_open)(const uint8_t *data, size_t length);
+
+    // Consume the next chunk, calling host->alloc once the size is known,
+    // update rows (completely decoded rows) and set done after the last one
+    int (*stream_write)(const images_host *host, void *target, void *state,
+            const uint8_t *data, size_t length, size_t *rows, int *done);
+
+    void (*stream_close)(void *state);
+} images_codec;
+
+// Return the type assigned to the codec, or 0 if it was refused
+typedef int (*images_register_codec)(void *registry, const images_codec *codec);
+
+typedef int (*images_codec_init_fn)(images_register_codec reg, void *registry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+// vim600: sw=4 ts=4 fdm=marker syn=cpp
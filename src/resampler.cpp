@@ -16,6 +16,18 @@
 #include <string.h>
 #include "resampler.h"
 
+// SIMD kernels for the X and Y passes, define RESAMPLER_NO_SIMD to use the plain loops only.
+// SSE2 is part of every x86-64 target, AVX2 (with FMA) is compiled in with GCC/Clang and picked at runtime.
+#if !defined(RESAMPLER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+   #define RESAMPLER_SSE2 1
+   #include <emmintrin.h>
+   #if !defined(RESAMPLER_NO_AVX2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+      #define RESAMPLER_AVX2 1
+      #define RESAMPLER_TARGET_AVX2 __attribute__((target("avx2,fma")))
+      #include <immintrin.h>
+   #endif
+#endif
+
 #define resampler_assert assert
 
 static inline int resampler_range_check(int v, int h) { (void)h; resampler_assert((v >= 0) && (v < h)); return v; }
@@ -727,6 +739,185 @@ Resampler::Contrib_List* Resampler::make_clist(
    return Pcontrib;
 }
 
+// Interleaved pixels, each contributor weighs all the channels of its pixel.
+static void resample_x_channels(Resampler::Sample* Pdst, const Resampler::Sample* Psrc, const Resampler::Contrib_List* Pclist, int dst_x, int channels)
+{
+   for (int i = dst_x; i > 0; i--, Pclist++, Pdst += channels)
+   {
+      const Resampler::Contrib* p = Pclist->p;
+      int c, j;
+
+      for (c = 0; c < channels; c++)
+         Pdst[c] = 0;
+
+      for (j = Pclist->n; j > 0; j--, p++)
+      {
+         const Resampler::Sample* s = Psrc + p->pixel * channels;
+         for (c = 0; c < channels; c++)
+            Pdst[c] += s[c] * p->weight;
+      }
+   }
+}
+
+#if RESAMPLER_SSE2
+// The kernels read a Contrib as a float weight followed by the pixel index in the low half of the next 32 bits.
+typedef char resampler_contrib_layout[(sizeof(Resample_Real) == 4 && sizeof(Resampler::Contrib) == 8) ? 1 : -1];
+
+static inline float resampler_hsum(__m128 v)
+{
+   v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+   v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+   return _mm_cvtss_f32(v);
+}
+
+// Four weights out of two Contrib pairs.
+static inline __m128 resampler_weights4(const Resampler::Contrib* p)
+{
+   return _mm_shuffle_ps(_mm_loadu_ps((const float*)p), _mm_loadu_ps((const float*)(p + 2)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+static inline float resampler_dot_scalar(float total, const Resampler::Contrib* p, int n, const float* Psrc)
+{
+   for ( ; n > 0; n--, p++)
+      total += Psrc[p->pixel] * p->weight;
+   return total;
+}
+
+// Lists covering a run of consecutive pixels (all but the clamped edges) read the samples with plain vector loads.
+static void resample_x_sse2(float* Pdst, const float* Psrc, const Resampler::Contrib_List* Pclist, const int* Pstart, int dst_x)
+{
+   for (int i = dst_x; i > 0; i--, Pclist++, Pstart++)
+   {
+      const Resampler::Contrib* p = Pclist->p;
+      int j = Pclist->n;
+
+      if (*Pstart < 0)
+      {
+         *Pdst++ = resampler_dot_scalar(0, p, j, Psrc);
+         continue;
+      }
+
+      const float* s = Psrc + *Pstart;
+      __m128 acc = _mm_setzero_ps();
+
+      for ( ; j >= 4; j -= 4, p += 4, s += 4)
+         acc = _mm_add_ps(acc, _mm_mul_ps(resampler_weights4(p), _mm_loadu_ps(s)));
+
+      *Pdst++ = resampler_dot_scalar(resampler_hsum(acc), p, j, Psrc);
+   }
+}
+
+// A pixel of four channels is one vector, so a contributor is a single multiply-add.
+static void resample_x4_sse2(float* Pdst, const float* Psrc, const Resampler::Contrib_List* Pclist, int dst_x)
+{
+   for (int i = dst_x; i > 0; i--, Pclist++, Pdst += 4)
+   {
+      const Resampler::Contrib* p = Pclist->p;
+      __m128 acc = _mm_setzero_ps();
+
+      for (int j = Pclist->n; j > 0; j--, p++)
+         acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(Psrc + p->pixel * 4), _mm_set1_ps(p->weight)));
+
+      _mm_storeu_ps(Pdst, acc);
+   }
+}
+
+static void scale_y_mov_sse2(float* Ptmp, const float* Psrc, float weight, int dst_x)
+{
+   __m128 w = _mm_set1_ps(weight);
+   int i = dst_x;
+
+   for ( ; i >= 4; i -= 4, Ptmp += 4, Psrc += 4)
+      _mm_storeu_ps(Ptmp, _mm_mul_ps(_mm_loadu_ps(Psrc), w));
+
+   for ( ; i > 0; i--)
+      *Ptmp++ = *Psrc++ * weight;
+}
+
+static void scale_y_add_sse2(float* Ptmp, const float* Psrc, float weight, int dst_x)
+{
+   __m128 w = _mm_set1_ps(weight);
+   int i = dst_x;
+
+   for ( ; i >= 4; i -= 4, Ptmp += 4, Psrc += 4)
+      _mm_storeu_ps(Ptmp, _mm_add_ps(_mm_loadu_ps(Ptmp), _mm_mul_ps(_mm_loadu_ps(Psrc), w)));
+
+   for ( ; i > 0; i--)
+      (*Ptmp++) += *Psrc++ * weight;
+}
+#endif
+
+#if RESAMPLER_AVX2
+static bool resampler_has_avx2()
+{
+   static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+   return has;
+}
+
+RESAMPLER_TARGET_AVX2
+static void resample_x_avx2(float* Pdst, const float* Psrc, const Resampler::Contrib_List* Pclist, const int* Pstart, int dst_x)
+{
+   for (int i = dst_x; i > 0; i--, Pclist++, Pstart++)
+   {
+      const Resampler::Contrib* p = Pclist->p;
+      int j = Pclist->n;
+
+      if (*Pstart < 0)
+      {
+         *Pdst++ = resampler_dot_scalar(0, p, j, Psrc);
+         continue;
+      }
+
+      const float* s = Psrc + *Pstart;
+      __m256 acc = _mm256_setzero_ps();
+
+      for ( ; j >= 8; j -= 8, p += 8, s += 8)
+      {
+         // The in-lane shuffle leaves the weights as 0 1 4 5 2 3 6 7, put the pairs back in order
+         __m256 w = _mm256_shuffle_ps(_mm256_loadu_ps((const float*)p), _mm256_loadu_ps((const float*)(p + 4)), _MM_SHUFFLE(2, 0, 2, 0));
+         w = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(w), _MM_SHUFFLE(3, 1, 2, 0)));
+         acc = _mm256_fmadd_ps(w, _mm256_loadu_ps(s), acc);
+      }
+
+      __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+      if (j >= 4)
+      {
+         acc4 = _mm_fmadd_ps(resampler_weights4(p), _mm_loadu_ps(s), acc4);
+         j -= 4;
+         p += 4;
+      }
+
+      *Pdst++ = resampler_dot_scalar(resampler_hsum(acc4), p, j, Psrc);
+   }
+}
+
+RESAMPLER_TARGET_AVX2
+static void scale_y_mov_avx2(float* Ptmp, const float* Psrc, float weight, int dst_x)
+{
+   __m256 w = _mm256_set1_ps(weight);
+   int i = dst_x;
+
+   for ( ; i >= 8; i -= 8, Ptmp += 8, Psrc += 8)
+      _mm256_storeu_ps(Ptmp, _mm256_mul_ps(_mm256_loadu_ps(Psrc), w));
+
+   for ( ; i > 0; i--)
+      *Ptmp++ = *Psrc++ * weight;
+}
+
+RESAMPLER_TARGET_AVX2
+static void scale_y_add_avx2(float* Ptmp, const float* Psrc, float weight, int dst_x)
+{
+   __m256 w = _mm256_set1_ps(weight);
+   int i = dst_x;
+
+   for ( ; i >= 8; i -= 8, Ptmp += 8, Psrc += 8)
+      _mm256_storeu_ps(Ptmp, _mm256_fmadd_ps(_mm256_loadu_ps(Psrc), w, _mm256_loadu_ps(Ptmp)));
+
+   for ( ; i > 0; i--)
+      (*Ptmp++) += *Psrc++ * weight;
+}
+#endif
+
 void Resampler::resample_x(Sample* Pdst, const Sample* Psrc)
 {
    resampler_assert(Pdst);
@@ -737,12 +928,37 @@ void Resampler::resample_x(Sample* Pdst, const Sample* Psrc)
    Contrib_List *Pclist = m_Pclist_x;
    Contrib *p;
 
-   for (i = m_resample_dst_x; i > 0; i--, Pclist++)
-   {
 #if RESAMPLER_DEBUG_OPS
-      total_ops += Pclist->n;
+   total_ops += count_ops(Pclist, m_resample_dst_x) * m_channels;
 #endif
 
+   if (m_channels != 1)
+   {
+#if RESAMPLER_SSE2
+      if (m_channels == 4)
+      {
+         resample_x4_sse2(Pdst, Psrc, Pclist, m_resample_dst_x);
+         return;
+      }
+#endif
+      resample_x_channels(Pdst, Psrc, Pclist, m_resample_dst_x, m_channels);
+      return;
+   }
+
+#if RESAMPLER_AVX2
+   if (resampler_has_avx2())
+   {
+      resample_x_avx2(Pdst, Psrc, Pclist, m_Pclist_x_start, m_resample_dst_x);
+      return;
+   }
+#endif
+#if RESAMPLER_SSE2
+   resample_x_sse2(Pdst, Psrc, Pclist, m_Pclist_x_start, m_resample_dst_x);
+   return;
+#endif
+
+   for (i = m_resample_dst_x; i > 0; i--, Pclist++)
+   {
       for (j = Pclist->n, p = Pclist->p, total = 0; j > 0; j--, p++)
          total += Psrc[p->pixel] * p->weight;
 
@@ -758,6 +974,18 @@ void Resampler::scale_y_mov(Sample* Ptmp, const Sample* Psrc, Resample_Real weig
    total_ops += dst_x;
 #endif
 
+#if RESAMPLER_AVX2
+   if (resampler_has_avx2())
+   {
+      scale_y_mov_avx2(Ptmp, Psrc, weight, dst_x);
+      return;
+   }
+#endif
+#if RESAMPLER_SSE2
+   scale_y_mov_sse2(Ptmp, Psrc, weight, dst_x);
+   return;
+#endif
+
    // Not += because temp buf wasn't cleared.
    for (i = dst_x; i > 0; i--)
       *Ptmp++ = *Psrc++ * weight;
@@ -769,6 +997,18 @@ void Resampler::scale_y_add(Sample* Ptmp, const Sample* Psrc, Resample_Real weig
    total_ops += dst_x;
 #endif
 
+#if RESAMPLER_AVX2
+   if (resampler_has_avx2())
+   {
+      scale_y_add_avx2(Ptmp, Psrc, weight, dst_x);
+      return;
+   }
+#endif
+#if RESAMPLER_SSE2
+   scale_y_add_sse2(Ptmp, Psrc, weight, dst_x);
+   return;
+#endif
+
    for (int i = dst_x; i > 0; i--)
       (*Ptmp++) += *Psrc++ * weight;
 }
@@ -809,9 +1049,9 @@ void Resampler::resample_y(Sample* Pdst)
       Psrc = m_Pscan_buf->scan_buf_l[j];
 
       if (!i)
-         scale_y_mov(Ptmp, Psrc, Pclist->p[i].weight, m_intermediate_x);
+         scale_y_mov(Ptmp, Psrc, Pclist->p[i].weight, m_intermediate_x * m_channels);
       else
-         scale_y_add(Ptmp, Psrc, Pclist->p[i].weight, m_intermediate_x);
+         scale_y_add(Ptmp, Psrc, Pclist->p[i].weight, m_intermediate_x * m_channels);
 
       /* If this source line doesn't contribute to any
       * more destination lines then mark the scanline buffer slot
@@ -840,7 +1080,7 @@ void Resampler::resample_y(Sample* Pdst)
    }
 
    if (m_lo < m_hi)
-      clamp(Pdst, m_resample_dst_x);
+      clamp(Pdst, m_resample_dst_x * m_channels);
 }
 
 bool Resampler::put_line(const Sample* Psrc)
@@ -882,7 +1122,7 @@ bool Resampler::put_line(const Sample* Psrc)
 
    if (!m_Pscan_buf->scan_buf_l[i])
    {
-      if ((m_Pscan_buf->scan_buf_l[i] = (Sample*)malloc(m_intermediate_x * sizeof(Sample))) == NULL)
+      if ((m_Pscan_buf->scan_buf_l[i] = (Sample*)malloc(m_intermediate_x * m_channels * sizeof(Sample))) == NULL)
       {
          m_status = STATUS_OUT_OF_MEMORY;
          return false;
@@ -895,7 +1135,7 @@ bool Resampler::put_line(const Sample* Psrc)
       resampler_assert(m_intermediate_x == m_resample_src_x);
 
       // Y-X resampling order
-      memcpy(m_Pscan_buf->scan_buf_l[i], Psrc, m_intermediate_x * sizeof(Sample));
+      memcpy(m_Pscan_buf->scan_buf_l[i], Psrc, m_intermediate_x * m_channels * sizeof(Sample));
    }
    else
    {
@@ -910,6 +1150,25 @@ bool Resampler::put_line(const Sample* Psrc)
    return true;
 }
 
+bool Resampler::put_line(const unsigned char* Psrc)
+{
+   int i, n = m_resample_src_x * m_channels;
+
+   if (!m_Psrc_buf)
+   {
+      if ((m_Psrc_buf = (Sample*)malloc(n * sizeof(Sample))) == NULL)
+      {
+         m_status = STATUS_OUT_OF_MEMORY;
+         return false;
+      }
+   }
+
+   for (i = 0; i < n; i++)
+      m_Psrc_buf[i] = Psrc[i] * (1.0f / 255.0f);
+
+   return put_line(m_Psrc_buf);
+}
+
 const Resampler::Sample* Resampler::get_line()
 {
    int i;
@@ -954,10 +1213,16 @@ Resampler::~Resampler()
       m_Ptmp_buf = NULL;
    }
 
+   free(m_Psrc_buf);
+   m_Psrc_buf = NULL;
+
    /* Don't deallocate a contibutor list
    * if the user passed us one of their own.
    */
 
+   free(m_Pclist_x_start);
+   m_Pclist_x_start = NULL;
+
    if ((m_Pclist_x) && (!m_clist_x_forced))
    {
       free(m_Pclist_x->p);
@@ -1027,7 +1292,8 @@ Resampler::Resampler(int src_x, int src_y,
                      Resample_Real filter_x_scale,
                      Resample_Real filter_y_scale,
                      Resample_Real src_x_ofs,
-                     Resample_Real src_y_ofs)
+                     Resample_Real src_y_ofs,
+                     int channels)
 {
    int i, j;
    Resample_Real support, (*func)(Resample_Real);
@@ -1036,6 +1302,7 @@ Resampler::Resampler(int src_x, int src_y,
    resampler_assert(src_y > 0);
    resampler_assert(dst_x > 0);
    resampler_assert(dst_y > 0);
+   resampler_assert(channels > 0);
 
 #if RESAMPLER_DEBUG_OPS
    total_ops = 0;
@@ -1046,10 +1313,13 @@ Resampler::Resampler(int src_x, int src_y,
 
    m_delay_x_resample = false;
    m_intermediate_x = 0;
+   m_channels = channels;
    m_Pdst_buf = NULL;
    m_Ptmp_buf = NULL;
+   m_Psrc_buf = NULL;
    m_clist_x_forced = false;
    m_Pclist_x = NULL;
+   m_Pclist_x_start = NULL;
    m_clist_y_forced = false;
    m_Pclist_y = NULL;
    m_Psrc_y_count = NULL;
@@ -1064,7 +1334,7 @@ Resampler::Resampler(int src_x, int src_y,
 
    m_boundary_op = boundary_op;
 
-   if ((m_Pdst_buf = (Sample*)malloc(m_resample_dst_x * sizeof(Sample))) == NULL)
+   if ((m_Pdst_buf = (Sample*)malloc(m_resample_dst_x * m_channels * sizeof(Sample))) == NULL)
    {
       m_status = STATUS_OUT_OF_MEMORY;
       return;
@@ -1105,6 +1375,22 @@ Resampler::Resampler(int src_x, int src_y,
       m_clist_x_forced = true;
    }
 
+   if ((m_Pclist_x_start = (int*)malloc(m_resample_dst_x * sizeof(int))) == NULL)
+   {
+      m_status = STATUS_OUT_OF_MEMORY;
+      return;
+   }
+
+   for (i = 0; i < m_resample_dst_x; i++)
+   {
+      Contrib_List* Pclist = &m_Pclist_x[i];
+
+      m_Pclist_x_start[i] = Pclist->n > 0 ? Pclist->p[0].pixel : -1;
+      for (j = 1; j < Pclist->n; j++)
+         if (Pclist->p[j].pixel != Pclist->p[0].pixel + j)
+            m_Pclist_x_start[i] = -1;
+   }
+
    if (!Pclist_y)
    {
       m_Pclist_y = make_clist(m_resample_src_y, m_resample_dst_y, m_boundary_op, func, support, filter_y_scale, src_y_ofs);
@@ -1197,7 +1483,7 @@ Resampler::Resampler(int src_x, int src_y,
 
    if (m_delay_x_resample)
    {
-      if ((m_Ptmp_buf = (Sample*)malloc(m_intermediate_x * sizeof(Sample))) == NULL)
+      if ((m_Ptmp_buf = (Sample*)malloc(m_intermediate_x * m_channels * sizeof(Sample))) == NULL)
       {
          m_status = STATUS_OUT_OF_MEMORY;
          return;
@@ -49,6 +49,7 @@ public:
    // sample_low/sample_high - Clamp output samples to specified range, or disable clamping if sample_low >= sample_high
    // Pclist_x/Pclist_y - Optional pointers to contributor lists from another instance of a Resampler
    // src_x_ofs/src_y_ofs - Offset input image by specified amount (fractional values okay)
+   // channels - Samples per pixel, rows are interleaved (RGBARGBA...) and all channels share one contributor walk
    Resampler(
       int src_x, int src_y,
       int dst_x, int dst_y,
@@ -60,7 +61,8 @@ public:
       Resample_Real filter_x_scale = 1.0f,
       Resample_Real filter_y_scale = 1.0f,
       Resample_Real src_x_ofs = 0.0f, 
-      Resample_Real src_y_ofs = 0.0f);
+      Resample_Real src_y_ofs = 0.0f,
+      int channels = 1);
 
    ~Resampler();
 
@@ -70,6 +72,9 @@ public:
    // false on out of memory.
    bool put_line(const Sample* Psrc);
 
+   // Same with 8-bit samples, mapped to 0..1.
+   bool put_line(const unsigned char* Psrc);
+
    // NULL if no scanlines are currently available (give the resampler more scanlines!)
    const Sample* get_line();
 
@@ -94,6 +99,7 @@ private:
 #endif
 
    int m_intermediate_x;
+   int m_channels;
 
    int m_resample_src_x;
    int m_resample_src_y;
@@ -104,10 +110,14 @@ private:
 
    Sample* m_Pdst_buf;
    Sample* m_Ptmp_buf;
+   Sample* m_Psrc_buf;
 
    Contrib_List* m_Pclist_x;
    Contrib_List* m_Pclist_y;
 
+   // First source pixel of each X contributor list covering consecutive pixels, -1 for the others (SIMD loads)
+   int* m_Pclist_x_start;
+
    bool m_clist_x_forced;
    bool m_clist_y_forced;
 
@@ -20,6 +20,10 @@ images("input.jpg")
     .size( 200 )
     .save("output_old.jpg");
 
+images("input.jpg")
+    .resize( 200, null, "lanczos4", { precision : "float" } )
+    .save("output_float.jpg");
+
 images("input.gif")
     .resize( 200 )
     .save("output_new_gif.jpg");
@@ -27,3 +31,54 @@ images("input.gif")
 images("input.gif")
     .size( 200 )
     .save("output_old_gif.jpg");
+
+images("input.jpg")
+    .resize( 200 )
+    .save("output.gif", { colors : 64, dither : true });
+
+images("input.png")
+    .save("output.qoi");
+
+// BI_BITFIELDS with an empty red mask, red reads as 0
+var bmp = new Buffer(74);
+bmp.fill(0);
+bmp.write("BM", 0);
+bmp.writeUInt32LE(74, 2);
+bmp.writeUInt32LE(66, 10);
+bmp.writeUInt32LE(40, 14);
+bmp.writeInt32LE(2, 18);
+bmp.writeInt32LE(1, 22);
+bmp.writeUInt16LE(1, 26);
+bmp.writeUInt16LE(32, 28);
+bmp.writeUInt32LE(3, 30);
+bmp.writeUInt32LE(0x0000FF00, 58);
+bmp.writeUInt32LE(0x000000FF, 62);
+bmp.writeUInt32LE(0x00FFFFFF, 66);
+images(bmp).save("output_bitfields.png");
+
+require("fs").writeFileSync("output_rotate.jpg",
+    images.jpegTransform(require("fs").readFileSync("input.jpg"), { rotate : 90 }));
+
+images("input.jpg")
+    .resize( 200 )
+    .encodeMany([{ type : "png" }, { type : "jpg", config : { quality : 80 } }], function(err, buffers) {
+        if (err) throw err;
+        require("fs").writeFileSync("output_many.png", buffers[0]);
+        require("fs").writeFileSync("output_many.jpg", buffers[1]);
+    });
+
+images.loadAnimation("input.gif")
+    .frame(0)
+    .resize( 200 )
+    .save("output_frame.png");
+
+images("input.jpg")
+    .resize( 200 )
+    .encodeStream("jpg")
+    .pipe(require("fs").createWriteStream("output_stream.jpg"));
+
+require("fs").createReadStream("input.png")
+    .pipe(images.createDecodeStream())
+    .on("image", function(image) {
+        image.resize( 200 ).save("output_stream.png");
+    });